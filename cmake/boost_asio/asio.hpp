@@ -0,0 +1,28 @@
+/*
+Fallback used by the CMake build when standalone Asio can't be found but Boost is installed.
+
+The sources are written against standalone Asio (namespace asio, std::error_code), so this
+header maps those names onto Boost.Asio. Only the names the bank actually uses are mapped.
+*/
+
+#ifndef BANK_BOOST_ASIO_COMPAT_HPP
+#define BANK_BOOST_ASIO_COMPAT_HPP
+
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+namespace boost {
+namespace asio {
+using boost::system::error_code;
+using boost::system::system_error;
+} // namespace asio
+} // namespace boost
+
+namespace asio = boost::asio;
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS) && !defined(ASIO_HAS_LOCAL_SOCKETS)
+#define ASIO_HAS_LOCAL_SOCKETS 1
+#endif
+
+#endif // BANK_BOOST_ASIO_COMPAT_HPP
@@ -0,0 +1,32 @@
+# Profile-guided build of the server: instrument, train with the bench load generator, rebuild.
+# Usage: scripts/pgo.sh [build dir] [connections] [requests per connection]
+set -e
+src=$(cd "$(dirname "$0")/.." && pwd)
+build=${1:-build-pgo}
+connections=${2:-8}
+requests=${3:-20000}
+port=45670
+
+mkdir -p "$build"
+build=$(cd "$build" && pwd)
+rm -rf "$build/pgo-profile" "$build/train"
+cmake -S "$src" -B "$build" -DCMAKE_BUILD_TYPE=Release -DBANK_PGO=generate
+cmake --build "$build" -j
+
+# train in a scratch directory so the server's accounts.db doesn't touch the real one
+mkdir -p "$build/train"
+cp "$src/quotes.txt" "$build/train"
+(cd "$build/train" && exec "$build/server" $port) &
+server=$!
+sleep 1
+"$build/bench" 127.0.0.1 $port "$connections" "$requests"
+kill -INT $server
+wait $server || true
+
+# Clang's raw profiles need merging first (GCC's .gcda files are used as they are)
+if ls "$build/pgo-profile"/*.profraw >/dev/null 2>&1; then
+    llvm-profdata merge -o "$build/pgo-profile/default.profdata" "$build/pgo-profile"/*.profraw
+fi
+
+cmake -S "$src" -B "$build" -DBANK_PGO=use
+cmake --build "$build" -j --clean-first
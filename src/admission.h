@@ -0,0 +1,165 @@
+/*
+Admission control: decides whether a request gets handled, and in what order.
+
+Every request that gets answered first has to get past token bucket rate limits for its
+connection and (once logged in) its account. It then waits in one of a few priority lanes on its connection's
+worker thread, so moving money normally goes ahead of informational reads like quotes.
+
+Each connection only sends its next request once the last one is answered, so lanes never get
+longer than the worker's number of connections and a queue limit alone rarely kicks in. What
+grows under overload is how long requests wait, so that's what is limited: a request that has
+waited longer than max_wait by the time its turn comes is answered with request_type::busy
+instead of being handled, rather than making everyone wait longer and longer. So that lower
+lanes aren't starved outright, a request that has waited over half of max_wait goes ahead of
+the lanes above it.
+
+Each worker (io_context) has its own admission_control, which is only ever used from that
+worker's thread, so none of this needs locking.
+*/
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "asio.hpp"
+#include "request.h"
+#include <chrono>
+#include <deque>
+#include <functional>
+
+// how many queued requests a worker handles before checking its sockets for more again
+#define ADMISSION_BATCH 8
+
+// Highest priority first
+enum class lane {
+    money,   // deposit, withdraw, transfer
+    session, // registering, logging in and out, changing passwords
+    info,    // everything that only reads
+    count
+};
+
+inline lane classify(request_type type) {
+    switch (type) {
+    case request_type::deposit:
+    case request_type::withdraw:
+    case request_type::transfer:
+        return lane::money;
+    case request_type::register_account:
+    case request_type::login:
+    case request_type::logout:
+    case request_type::change_password:
+        return lane::session;
+    default:
+        return lane::info;
+    }
+}
+
+// Whether the server answers a request of this type, from a connection that is or isn't logged
+// in. Requests it doesn't answer are never turned away with busy either, since the client isn't
+// waiting for a reply and wouldn't expect one.
+inline bool is_answered(request_type type, bool logged_in) {
+    switch (type) {
+    case request_type::register_account:
+    case request_type::login:
+    case request_type::get_totals:
+    case request_type::get_top_balances:
+    case request_type::get_balance_histogram:
+    case request_type::backup:
+        return true;
+    case request_type::get_balance:
+    case request_type::get_id:
+    case request_type::get_quote:
+    case request_type::deposit:
+    case request_type::withdraw:
+    case request_type::transfer:
+    case request_type::change_password:
+        return logged_in;
+    default:
+        return false; // logouts, and anything clients shouldn't be sending
+    }
+}
+
+struct admission_settings {
+    typedef std::chrono::steady_clock clock;
+
+    double connection_rate = 0; // requests per second allowed per connection, 0 for no limit
+    double account_rate = 0;    // requests per second allowed per logged in account, 0 for no limit
+    size_t queue_limit = 1024;  // requests each lane of a worker holds before the server is busy
+    // how long a request may wait in its lane before it's answered with busy, 0 for no limit
+    clock::duration max_wait = std::chrono::milliseconds(1000);
+};
+
+class admission_control {
+public:
+    admission_control(asio::io_context &io_context, const admission_settings &settings) : io_context(io_context), settings_(settings) {
+    }
+
+    const admission_settings &settings() const {
+        return settings_;
+    }
+
+    // Queues task in its lane, or returns false (and the request should be answered with busy)
+    // if that lane is full. When its turn comes, task is called with whether it waited longer
+    // than max_wait, in which case it should answer busy too instead of handling the request.
+    // Forced tasks are queued regardless, and never told to answer busy.
+    bool submit(lane l, std::function<void(bool)> task, bool force = false) {
+        std::deque<queued> &queue = lanes[(int) l];
+        if (!force && queue.size() >= settings_.queue_limit)
+            return false;
+        queue.push_back(queued{std::move(task), admission_settings::clock::now(), force});
+        if (!draining) {
+            draining = true;
+            // posted rather than run now, so requests that arrived at the same time all get
+            // queued (and sorted into lanes) before any of them is handled
+            asio::post(io_context, std::bind(&admission_control::drain, this));
+        }
+        return true;
+    }
+
+private:
+    struct queued {
+        std::function<void(bool)> task;
+        admission_settings::clock::time_point since;
+        bool force;
+    };
+
+    // The lane to take from next: the highest priority one with anything in it, unless a lower
+    // lane's oldest request has waited over half of max_wait
+    std::deque<queued> *next_lane(admission_settings::clock::time_point now) {
+        std::deque<queued> *next = nullptr;
+        for (std::deque<queued> &q : lanes) {
+            if (q.empty())
+                continue;
+            if (!next)
+                next = &q;
+            else if (settings_.max_wait.count() && now - q.front().since > settings_.max_wait / 2 && q.front().since < next->front().since)
+                next = &q;
+        }
+        return next;
+    }
+
+    void drain() {
+        for (int handled = 0; handled < ADMISSION_BATCH;) {
+            admission_settings::clock::time_point now = admission_settings::clock::now();
+            std::deque<queued> *queue = next_lane(now);
+            if (!queue) {
+                draining = false;
+                return;
+            }
+            queued next = std::move(queue->front());
+            queue->pop_front();
+            bool too_late = !next.force && settings_.max_wait.count() && now - next.since > settings_.max_wait;
+            next.task(too_late);
+            if (!too_late)
+                handled++; // answering busy is cheap, so it doesn't use up the batch
+        }
+        // let newly arrived requests in before carrying on, in case they're more important
+        asio::post(io_context, std::bind(&admission_control::drain, this));
+    }
+
+    asio::io_context &io_context;
+    admission_settings settings_;
+    std::deque<queued> lanes[(int) lane::count];
+    bool draining = false;
+};
+
+#endif // ADMISSION_H
@@ -0,0 +1,75 @@
+/*
+Runs the admin's backup requests: database::backup to a file, or streamed to a Unix domain socket.
+
+Targets come from the network, so they're only ever plain names inside the backup directory the
+server was started with (--backup-dir), never paths: otherwise a backup could overwrite any file
+the server can write to, accounts.db included.
+
+Backups run on the report threads (see reports.h), so a receiver on the socket that stops
+reading mustn't be able to hold one up forever: the connect and every chunk get BACKUP_TIMEOUT,
+after which the socket is closed and the backup fails.
+*/
+
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include "asio.hpp"
+#include "database.h"
+#include <chrono>
+#include <string>
+
+// seconds a backup to a Unix domain socket waits for the receiver to connect or take each chunk
+#define BACKUP_TIMEOUT 30
+
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+// Runs the operation waiting on socket, closing the socket (which cancels it) if it takes longer
+// than timeout. Returns false if it timed out.
+inline bool run_with_timeout(asio::io_context &io_context, asio::local::stream_protocol::socket &socket, std::chrono::steady_clock::duration timeout) {
+    io_context.restart();
+    io_context.run_for(timeout);
+    if (io_context.stopped())
+        return true; // finished, one way or another
+    asio::error_code ignored;
+    socket.close(ignored);
+    io_context.run(); // lets the cancelled operation's handler run
+    return false;
+}
+#endif
+
+// Whether name is just a file name, with no way of pointing outside the directory it's put in
+inline bool is_backup_name(const std::string &name) {
+    return !name.empty() && name != "." && name != ".." && name.find_first_of("/\\:") == std::string::npos;
+}
+
+// Backs up to the file called target in dir, or with a target of unix:<name>, streams the backup
+// to whoever is listening on the Unix domain socket called name in dir. Returns database::backup's
+// status, or 4 if there's no backup directory or target isn't a plain name.
+inline int run_backup(database &db, const std::string &dir, std::string target, std::chrono::steady_clock::duration timeout = std::chrono::seconds(BACKUP_TIMEOUT)) {
+    bool to_socket = !target.compare(0, 5, "unix:");
+    std::string name = to_socket ? target.substr(5) : target;
+    if (dir.empty() || !is_backup_name(name))
+        return 4; // invalid target
+    std::string path = dir + "/" + name;
+    if (!to_socket)
+        return db.backup(path);
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+    asio::io_context io_context;
+    asio::local::stream_protocol::socket socket(io_context);
+    asio::error_code ec;
+    socket.async_connect(asio::local::stream_protocol::endpoint(path), [&](const asio::error_code &error) {
+        ec = error;
+    });
+    if (!run_with_timeout(io_context, socket, timeout) || ec)
+        return 3; // could not write the backup
+    return db.backup([&](const std::string &chunk) {
+        asio::async_write(socket, asio::buffer(chunk), [&](const asio::error_code &error, size_t) {
+            ec = error;
+        });
+        return run_with_timeout(io_context, socket, timeout) && !ec;
+    });
+#else
+    return 3;
+#endif
+}
+
+#endif // BACKUP_H
@@ -0,0 +1,244 @@
+/*
+Load generator for the bank server. It's used both for measuring throughput/latency and as the
+training run for profile-guided builds (see scripts/pgo.sh).
+
+Usage:
+    bench [--connect] [host] [port] [connections] [requests per connection]
+
+A host of unix:<path> connects to the server's Unix domain socket instead (the port is ignored).
+
+With --connect it measures connection setup instead: each of the threads repeatedly opens a
+new connection, waits for the server to answer one request on it, and closes it again. The
+rate and latency reported are for the whole connect, accept and first response.
+
+Each connection runs on its own thread, registers a fresh account, and then sends a mix of
+deposits, withdrawals, balance checks, quotes and transfers (to a shared sink account that
+nobody is logged into), blocking on each response like the real client does.
+
+Requests the server turns away with busy are counted and timed separately, since including
+those quick rejections would make throughput and latency look better than they are.
+*/
+
+#include "request.h"
+#include <algorithm>
+#include <asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using asio::ip::tcp;
+typedef asio::generic::stream_protocol::socket bench_socket;
+typedef std::chrono::steady_clock bench_clock;
+
+std::string host = "127.0.0.1", port = "4567";
+std::string run_id; // keeps account names unique between runs against the same accounts.db
+std::atomic<unsigned long long> failed_connections(0);
+
+// One thread's latencies in nanoseconds, of the requests the server answered and of the ones it
+// turned away (busy)
+struct latencies {
+    std::vector<long long> answered;
+    std::vector<long long> busy;
+
+    void record(bench_clock::time_point start, bool was_busy) {
+        (was_busy ? busy : answered).push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count());
+    }
+};
+
+void connect(bench_socket &socket, asio::io_context &io_context) {
+    if (host.compare(0, 5, "unix:") == 0) {
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+        socket.connect(asio::local::stream_protocol::endpoint(host.substr(5)));
+        return;
+#else
+        throw std::runtime_error("Unix domain sockets aren't supported on this platform");
+#endif
+    }
+    asio::error_code ec = asio::error::host_not_found;
+    for (const tcp::resolver::results_type::value_type &entry : tcp::resolver(io_context).resolve(host, port)) {
+        if (socket.is_open())
+            socket.close();
+        socket.connect(entry.endpoint(), ec);
+        if (!ec) {
+            socket.set_option(tcp::no_delay(true));
+            return;
+        }
+    }
+    throw asio::system_error(ec);
+}
+
+// Blocks until the data is read
+void read_response(bench_socket &socket, request &response) {
+    asio::read(socket, asio::buffer(&response.header, sizeof(request_header)));
+    asio::read(socket, asio::buffer(response.body, response.header.body_size));
+}
+
+// Sends a request and waits for the response. Returns whether the server was too busy for it.
+bool send_and_wait(bench_socket &socket, request_type type, std::string body) {
+    request response;
+    new_request(type, body).send(socket);
+    read_response(socket, response);
+    return response.header.type == request_type::busy;
+}
+
+// send_and_wait, timed
+void round_trip(bench_socket &socket, request_type type, std::string body, latencies &l) {
+    bench_clock::time_point start = bench_clock::now();
+    l.record(start, send_and_wait(socket, type, body));
+}
+
+// For the requests the rest of a connection depends on (the server doesn't answer anything but
+// logging in while logged out): tries again a moment later for as long as the server is busy
+void send_until_answered(bench_socket &socket, request_type type, std::string body, request &response) {
+    for (;;) {
+        new_request(type, body).send(socket);
+        read_response(socket, response);
+        if (response.header.type != request_type::busy)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+void open_account(bench_socket &socket, std::string name) {
+    std::string pw_hash = std::to_string(std::hash<std::string>()(name));
+    request response;
+    send_until_answered(socket, request_type::register_account, name + " " + pw_hash, response);
+    if (atoi(response.body)) // name taken, so it's ours from an earlier run
+        send_until_answered(socket, request_type::login, name + " " + pw_hash, response);
+}
+
+void run_connection(int id, int requests, latencies &l) {
+    try {
+        asio::io_context io_context;
+        bench_socket socket(io_context);
+        connect(socket, io_context);
+        open_account(socket, "b" + run_id + "_" + std::to_string(id));
+        l.answered.reserve(requests);
+        for (int i = 0; i < requests; i++) {
+            switch (i % 8) {
+            case 0:
+            case 1:
+                round_trip(socket, request_type::deposit, "1000", l);
+                break;
+            case 2:
+                round_trip(socket, request_type::withdraw, "300", l);
+                break;
+            case 3:
+            case 4:
+                round_trip(socket, request_type::get_balance, "", l);
+                break;
+            case 5:
+                round_trip(socket, request_type::get_quote, std::to_string(i), l);
+                break;
+            default:
+                round_trip(socket, request_type::transfer, "b" + run_id + "_sink 100", l);
+                break;
+            }
+        }
+        new_request(request_type::logout, "").send(socket);
+    } catch (std::exception &e) {
+        failed_connections++;
+        std::cerr << "connection " << id << ": " << e.what() << std::endl;
+    }
+}
+
+void run_connects(int id, int count, latencies &l) {
+    asio::io_context io_context;
+    l.answered.reserve(count);
+    for (int i = 0; i < count; i++) {
+        try {
+            bench_socket socket(io_context);
+            bench_clock::time_point start = bench_clock::now();
+            connect(socket, io_context);
+            // a login that can't succeed is answered without touching the accounts file
+            l.record(start, send_and_wait(socket, request_type::login, "b" + run_id + "_nobody 0"));
+        } catch (std::exception &e) {
+            if (!failed_connections++)
+                std::cerr << "connection " << id << ": " << e.what() << std::endl;
+        }
+    }
+}
+
+// The sink account must exist and be logged out before anyone can transfer to it
+bool open_sink() {
+    try {
+        asio::io_context io_context;
+        bench_socket socket(io_context);
+        connect(socket, io_context);
+        open_account(socket, "b" + run_id + "_sink");
+        new_request(request_type::logout, "").send(socket);
+        // the server doesn't answer logouts, so make sure it went through with a request that's
+        // answered while logged out (registering a taken name just fails)
+        request response;
+        send_until_answered(socket, request_type::register_account, "b" + run_id + "_sink 0", response);
+        return true;
+    } catch (std::exception &e) {
+        std::cerr << "Could not reach server: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+long long percentile(const std::vector<long long> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+}
+
+int main(int argc, char **argv) {
+    int connections = 8, requests = 10000;
+    bool connect_mode = false;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--connect")
+            connect_mode = true;
+        else
+            args.push_back(argv[i]);
+    }
+    if (args.size() > 0)
+        host = args[0];
+    if (args.size() > 1)
+        port = args[1];
+    if (args.size() > 2)
+        connections = atoi(args[2].c_str());
+    if (args.size() > 3)
+        requests = atoi(args[3].c_str());
+    run_id = std::to_string(std::chrono::system_clock::now().time_since_epoch().count() % 1000000000);
+
+    if (!connect_mode && !open_sink())
+        return 1;
+
+    std::vector<latencies> results(connections);
+    std::vector<std::thread> threads;
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < connections; i++)
+        threads.emplace_back(connect_mode ? run_connects : run_connection, i, requests, std::ref(results[i]));
+    for (std::thread &t : threads)
+        t.join();
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    std::vector<long long> all, busy;
+    for (latencies &l : results) {
+        all.insert(all.end(), l.answered.begin(), l.answered.end());
+        busy.insert(busy.end(), l.busy.begin(), l.busy.end());
+    }
+    std::sort(all.begin(), all.end());
+    std::sort(busy.begin(), busy.end());
+
+    const char *unit = connect_mode ? "connects" : "requests";
+    std::cout << "connections: " << connections << " (" << failed_connections << " failed)" << std::endl
+              << unit << ":    " << all.size() << " answered in " << seconds << " s" << std::endl
+              << "throughput:  " << (unsigned long long) (all.size() / seconds) << " " << (connect_mode ? "conn/s" : "req/s") << std::endl
+              << "latency us:  p50 " << percentile(all, 0.5) / 1000.0
+              << "  p99 " << percentile(all, 0.99) / 1000.0
+              << "  p99.9 " << percentile(all, 0.999) / 1000.0
+              << "  max " << (all.empty() ? 0 : all.back()) / 1000.0 << std::endl
+              << "busy:        " << busy.size() << " turned away";
+    if (!busy.empty())
+        std::cout << ", latency us p50 " << percentile(busy, 0.5) / 1000.0 << "  max " << busy.back() / 1000.0;
+    std::cout << std::endl;
+    return failed_connections ? 1 : 0;
+}
@@ -4,9 +4,12 @@ This program is what users will use to interact with the bank server.
 
 #include "account.h"
 #include "request.h"
+#include <algorithm>
 #include <asio.hpp>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <thread>
 
 using asio::ip::tcp;
 
@@ -37,6 +40,18 @@ void read_response(tcp::socket &socket) {
     response_scanner = std::stringstream(response.body);
 }
 
+// Sends a request and blocks until its response arrives. An overloaded server answers with busy
+// instead, in which case we back off for a bit and try again.
+void send_request(tcp::socket &socket, request_type type, std::string body) {
+    for (int wait_ms = 50;; wait_ms = std::min(wait_ms * 2, 2000)) {
+        new_request(type, body).send(socket);
+        read_response(socket);
+        if (response.header.type != request_type::busy)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+    }
+}
+
 // Handy util function for multiple choice menus
 int term_menu(std::string prompt, int argc, const std::string argv[]) {
     std::cout << prompt << std::endl;
@@ -99,7 +114,7 @@ int main() {
         try {
             asio::connect(socket, endpoints);
             current_state = state::entrance;
-        } catch (std::system_error &e) {
+        } catch (asio::system_error &e) {
             current_state = state::connection_failed;
         }
 
@@ -118,7 +133,7 @@ int main() {
                         host_save << host << " " << port;
                         host_save.close();
                         current_state = state::entrance;
-                    } catch (std::system_error &e) {
+                    } catch (asio::system_error &e) {
                         current_state = state::connection_failed;
                     }
                 } else {
@@ -143,14 +158,12 @@ int main() {
                 std::string name = input<std::string>("Account name: ");
                 std::string password = input<std::string>("Password: ");
                 unsigned long long pw_hash = std::hash<std::string>()(password);
-                new_request(request_type::login, name + " " + std::to_string(pw_hash)).send(socket);
-                read_response(socket);
+                send_request(socket, request_type::login, name + " " + std::to_string(pw_hash));
                 int error;
                 if (!(error = atoi(response.body))) {
                     user.name = name;
                     user.pw_hash = pw_hash;
-                    new_request(request_type::get_balance, "").send(socket);
-                    read_response(socket);
+                    send_request(socket, request_type::get_balance, "");
                     response_scanner >> user.balance;
                     current_state = state::main_menu;
                 } else {
@@ -166,13 +179,11 @@ int main() {
                 std::string name = input<std::string>("New account name: ");
                 std::string password = input<std::string>("Password: ");
                 unsigned long long pw_hash = std::hash<std::string>()(password);
-                new_request(request_type::register_account, name + " " + std::to_string(pw_hash)).send(socket);
-                read_response(socket);
+                send_request(socket, request_type::register_account, name + " " + std::to_string(pw_hash));
                 if (!atoi(response.body)) {
                     user.name = name;
                     user.pw_hash = pw_hash;
-                    new_request(request_type::get_balance, "").send(socket);
-                    read_response(socket);
+                    send_request(socket, request_type::get_balance, "");
                     response_scanner >> user.balance;
                     current_state = state::main_menu;
                 } else {
@@ -183,8 +194,7 @@ int main() {
             }
             case state::main_menu: {
                 std::cout << "Hello " << user.name << "." << std::endl;
-                new_request(request_type::get_id, "").send(socket);
-                read_response(socket);
+                send_request(socket, request_type::get_id, "");
                 std::cout << "ID: " << strtoull(response.body, nullptr, 10) << std::endl;
                 std::cout << "Your balance is currently $" << (user.balance / 100) << ".";
                 if (user.balance % 100 < 10)
@@ -219,8 +229,7 @@ int main() {
                     double amount = input<double>("Deposit amount: $");
                     if (amount <= 0) throw 1;
                     unsigned long long int_amount = (unsigned long long) (amount * 100);
-                    new_request(request_type::deposit, std::to_string(int_amount)).send(socket);
-                    read_response(socket);
+                    send_request(socket, request_type::deposit, std::to_string(int_amount));
                     response_scanner >> user.balance;
                 } catch (int e) {
                     std::cout << "Please enter a positive number." << std::endl;
@@ -233,8 +242,7 @@ int main() {
                     double amount = input<double>("Withdraw amount: $");
                     if (amount < 0) throw 1;
                     unsigned long long int_amount = (unsigned long long) (amount * 100);
-                    new_request(request_type::withdraw, std::to_string(int_amount)).send(socket);
-                    read_response(socket);
+                    send_request(socket, request_type::withdraw, std::to_string(int_amount));
                     int error;
                     response_scanner >> error >> user.balance;
                     if (error)
@@ -251,8 +259,7 @@ int main() {
                     double amount = input<double>("Transfer amount: $");
                     if (amount < 0) throw 1;
                     unsigned long long int_amount = (unsigned long long) (amount * 100);
-                    new_request(request_type::transfer, name + " " + std::to_string(int_amount)).send(socket);
-                    read_response(socket);
+                    send_request(socket, request_type::transfer, name + " " + std::to_string(int_amount));
                     int error;
                     response_scanner >> error >> user.balance;
                     switch (error) {
@@ -278,8 +285,7 @@ int main() {
                 unsigned long long old_pw_hash = std::hash<std::string>()(old_password);
                 if (old_pw_hash == user.pw_hash) {
                     unsigned long long new_pw_hash = std::hash<std::string>()(new_password);
-                    new_request(request_type::change_password, std::to_string(old_pw_hash) + " " + std::to_string(new_pw_hash)).send(socket);
-                    read_response(socket);
+                    send_request(socket, request_type::change_password, std::to_string(old_pw_hash) + " " + std::to_string(new_pw_hash));
                     if (!atoi(response.body))
                         user.pw_hash = new_pw_hash;
                     else
@@ -293,8 +299,7 @@ int main() {
             case state::quote: {
                 try {
                     int seed = input<int>("Enter your lucky number: ");
-                    new_request(request_type::get_quote, std::to_string(seed)).send(socket);
-                    read_response(socket);
+                    send_request(socket, request_type::get_quote, std::to_string(seed));
                     std::cout << response.body << std::endl;
                     current_state = state::main_menu;
                 } catch (int e) {
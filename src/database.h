@@ -2,7 +2,14 @@
 Class database represents an interface for the server to acceess the data file (accounts.db).
 
 You wouldn't want different client connections all accessing (or worse, writing) to the file
-at the same time, so this class uses a mutex to ensure all operations stay exclusive.
+at the same time, so this class uses mutexes to keep things exclusive:
+    mutex       the accounts in memory (the list, passwords and balances). It's only ever held
+                for quick in-memory work, never for file I/O, so requests on different threads
+                barely wait on each other.
+    file_mutex  writes to the data file, so they land in order. Always taken before mutex.
+    quote_mutex get_quote, which isn't thread safe (rand) and reads its own file.
+    rate_shards the accounts' rate limits, split across RATE_SHARDS locks so requests on
+                different threads rarely wait on each other for them.
 
 In server.cpp, class server has the only instance of a database, whose reference is passed to
 all connections (i.e. all connections use the same database).
@@ -12,14 +19,51 @@ all connections (i.e. all connections use the same database).
 #define DATABASE_H
 
 #include "account.h"
+#include "token_bucket.h"
 #include <algorithm>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <memory>
 #include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+#ifdef _WIN32
+// without winsock.h (which clashes with Asio's winsock2.h) or the min and max macros
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
 
 #define DB_FILE "accounts.db"
+// how many records scan_accounts copies each time it takes the mutex
+#define SCAN_BATCH 1024
+// how many locks the accounts' rate limits are split across
+#define RATE_SHARDS 64
+
+// An account's password hash and balance as of when a scan_accounts started
+struct account_record {
+    const account *owner;
+    unsigned long long pw_hash;
+    unsigned long long balance;
+};
+
+// Balances of every account at one point in time. balances is a plain array so reports can scan
+// it quickly; owners[i] is the account balances[i] belongs to. Accounts are never removed and
+// their names never change, so the raw pointers (which unlike shared_ptr copies don't count as
+// someone being logged in) stay valid for as long as the database does.
+struct balance_snapshot {
+    std::vector<unsigned long long> balances;
+    std::vector<const account *> owners;
+};
 
 class database {
 public:
@@ -42,12 +86,17 @@ public:
     }
 
     account::pointer register_account(std::string name, unsigned long long pw_hash) {
-        const std::lock_guard<std::mutex> lock(mutex);
-        for (account::pointer a : accounts)
-            if (a->name == name)
-                return account::pointer(); // failed to create account due to name conflict
-        account::pointer new_account = account::create(name, pw_hash, 0);
-        accounts.push_back(new_account);
+        // held throughout, so the file's lines stay in the same order as accounts
+        const std::lock_guard<std::mutex> file_lock(file_mutex);
+        account::pointer new_account;
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            for (const account::pointer &a : accounts)
+                if (a->name == name)
+                    return account::pointer(); // failed to create account due to name conflict
+            new_account = account::create(name, pw_hash, 0);
+            accounts.push_back(new_account);
+        }
         std::ofstream out(DB_FILE, std::ofstream::app);
         out << std::setw(NAME_WIDTH) << name << std::setw(PW_HASH_WIDTH) << pw_hash << std::setw(BALANCE_WIDTH) << 0 << std::endl;
         out.close();
@@ -56,28 +105,28 @@ public:
 
     // We don't actually commit any account updates to the data file until the user logs out
     int commit_updates(account::pointer updated) {
-        const std::lock_guard<std::mutex> lock(mutex);
-        auto i = std::find(accounts.begin(), accounts.end(), updated);
-        if (i == accounts.end())
-            return 1; // could not find account
-        std::fstream file(DB_FILE, std::fstream::in | std::fstream::out | std::fstream::binary);
-        std::string garbage;
-        for (auto j = accounts.begin(); j < i; j++) {
-            std::getline(file, garbage);
-        }
-        std::string name;
-        if (file >> name && name == updated->name) {
-            file << std::setw(PW_HASH_WIDTH) << updated->pw_hash << std::setw(BALANCE_WIDTH) << updated->balance;
-            file.close();
-            return 0;
+        size_t index;
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            auto i = std::find(accounts.begin(), accounts.end(), updated);
+            if (i == accounts.end())
+                return 1; // could not find account
+            index = i - accounts.begin();
         }
-        file.close();
-        return 2; // error editing account info
+        return write_record(index);
+    }
+
+    bool has_account(std::string name) {
+        const std::lock_guard<std::mutex> lock(mutex);
+        for (const account::pointer &a : accounts)
+            if (a->name == name)
+                return true;
+        return false;
     }
 
     account::pointer get_account(std::string name, unsigned long long pw_hash) {
         const std::lock_guard<std::mutex> lock(mutex);
-        for (account::pointer a : accounts) {
+        for (const account::pointer &a : accounts) {
             if (a->name == name && a->pw_hash == pw_hash) {
                 return a;
             }
@@ -85,34 +134,200 @@ public:
         return account::pointer(); // could not find account; return an empty pointer instead
     }
 
-    int transfer(std::string dest_account, unsigned long long amount) {
+    // Balances and passwords only change in here (under the mutex), so a scan never sees half
+    // of a transfer and scans in progress get the chance to save the old values first
+    unsigned long long deposit(const account::pointer &user, unsigned long long amount) {
         const std::lock_guard<std::mutex> lock(mutex);
-        auto i = std::find_if(accounts.begin(), accounts.end(), [&](account::pointer a) {
-            return a->name == dest_account;
-        });
-        if (i == accounts.end())
-            return 2; // could not find account
-        if ((*i).use_count() > 1) // another tcp_connection has a copy of the account pointer, i.e. the user is logged in
-            return 3; // can't transfer while someone else is using the account
-        (*i)->balance += amount;
-        std::fstream file(DB_FILE, std::fstream::in | std::fstream::out | std::fstream::binary);
-        std::string garbage;
-        for (auto j = accounts.begin(); j < i; j++) {
-            std::getline(file, garbage);
+        preserve_for_scans(user.get());
+        user->balance += amount;
+        return user->balance;
+    }
+
+    int withdraw(const account::pointer &user, unsigned long long amount) {
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (amount > user->balance)
+            return 1; // amount is invalid
+        preserve_for_scans(user.get());
+        user->balance -= amount;
+        return 0;
+    }
+
+    int change_password(const account::pointer &user, unsigned long long old_pw_hash, unsigned long long new_pw_hash) {
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (old_pw_hash != user->pw_hash)
+            return 1; // fail
+        preserve_for_scans(user.get());
+        user->pw_hash = new_pw_hash;
+        return 0;
+    }
+
+    int transfer(const account::pointer &from, std::string dest_account, unsigned long long amount) {
+        // A copy of dest's pointer makes it count as in use (like someone being logged in), so
+        // until it's let go nobody else can log in to dest, transfer to it or otherwise change
+        // its balance, and the transfer can always be undone if the file can't be written
+        account::pointer dest;
+        size_t index;
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            if (amount > from->balance)
+                return 1; // amount is invalid
+            auto i = std::find_if(accounts.begin(), accounts.end(), [&](const account::pointer &a) {
+                return a->name == dest_account;
+            });
+            if (i == accounts.end())
+                return 2; // could not find account
+            if ((*i).use_count() > 1) // another tcp_connection has a copy of the account pointer, i.e. the user is logged in
+                return 3; // can't transfer while someone else is using the account
+            preserve_for_scans(from.get());
+            preserve_for_scans(i->get());
+            (*i)->balance += amount;
+            from->balance -= amount;
+            dest = *i;
+            index = i - accounts.begin();
         }
-        std::string name;
-        unsigned long long pw_hash;
-        if (file >> name && name == dest_account && file >> pw_hash) {
-            file << std::setw(BALANCE_WIDTH) << (*i)->balance;
-            file.close();
+
+        // Nobody is logged in to dest to save its new balance later, so it's written now, but
+        // after letting go of the mutex so other requests don't wait on the file
+        if (!write_record(index))
             return 0;
+        const std::lock_guard<std::mutex> lock(mutex);
+        preserve_for_scans(from.get());
+        preserve_for_scans(dest.get());
+        dest->balance -= amount;
+        from->balance += amount;
+        return 4; // error editing account info (and nothing was transferred)
+    }
+
+    // Calls visit with every account as it was when the scan started, a batch of records at a
+    // time (visit returns false to stop early). The records are copied SCAN_BATCH at a time, so
+    // the mutex is never held for long and everyone else carries on as usual. Consistency comes
+    // from copy on write: while a scan runs, the first change to each account saves its old
+    // values (see preserve_for_scans), so the extra work is only for the accounts that change
+    // during the scan. Any number of scans can run at once.
+    // Returns false if visit stopped the scan.
+    bool scan_accounts(const std::function<bool(const std::vector<account_record> &)> &visit) {
+        scan current;
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            current.end = accounts.size(); // accounts registered from now on aren't part of the scan
+            scans.push_back(&current);
         }
-        file.close();
-        return 4; // error editing account info
+        // stops saving values for this scan however it ends (visit may throw)
+        struct unregister {
+            database &db;
+            scan *current;
+            ~unregister() {
+                const std::lock_guard<std::mutex> lock(db.mutex);
+                db.scans.erase(std::find(db.scans.begin(), db.scans.end(), current));
+            }
+        } unregister_scan{*this, &current};
+
+        std::vector<account_record> batch;
+        for (size_t next = 0; next < current.end; next += SCAN_BATCH) {
+            batch.clear();
+            {
+                const std::lock_guard<std::mutex> lock(mutex);
+                for (size_t i = next; i < current.end && i < next + SCAN_BATCH; i++) {
+                    const account *a = accounts[i].get();
+                    auto saved = current.saved.find(a);
+                    if (saved == current.saved.end())
+                        batch.push_back(account_record{a, a->pw_hash, a->balance});
+                    else
+                        batch.push_back(account_record{a, saved->second.first, saved->second.second});
+                }
+            }
+            if (!visit(batch))
+                return false;
+        }
+        return true;
+    }
+
+    // Every balance at one point in time, for reports. Taken with scan_accounts, so it doesn't
+    // hold up anyone else either.
+    balance_snapshot snapshot_balances() {
+        balance_snapshot snapshot;
+        scan_accounts([&](const std::vector<account_record> &batch) {
+            for (const account_record &r : batch) {
+                snapshot.balances.push_back(r.balance);
+                snapshot.owners.push_back(r.owner);
+            }
+            return true;
+        });
+        return snapshot;
+    }
+
+    // Writes every account as it was when the backup started, in the same format as the data
+    // file, by passing chunks of it to write (which returns false to give up). Only one backup
+    // runs at a time; see scan_accounts for how it stays consistent.
+    // Returns 0 on success, 2 if another backup is running, 3 if write failed.
+    int backup(std::function<bool(const std::string &)> write) {
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            if (backup_running)
+                return 2; // another backup is running
+            backup_running = true;
+        }
+        // lets the next backup run however this one ends (write may throw)
+        struct finish {
+            database &db;
+            ~finish() {
+                const std::lock_guard<std::mutex> lock(db.mutex);
+                db.backup_running = false;
+            }
+        } finish_backup{*this};
+        bool ok = scan_accounts([&](const std::vector<account_record> &batch) {
+            // names never change, so they're safe to read without the mutex
+            std::ostringstream out;
+            for (const account_record &r : batch)
+                out << std::setw(NAME_WIDTH) << r.owner->name << std::setw(PW_HASH_WIDTH) << r.pw_hash << std::setw(BALANCE_WIDTH) << r.balance << '\n';
+            return write(out.str());
+        });
+        return ok ? 0 : 3;
+    }
+
+    // backup() to a file. It's written next to path first and renamed into place once complete,
+    // so path is never a partial backup.
+    int backup(std::string path) {
+        std::string temp_path = path + ".tmp";
+        std::ofstream out(temp_path, std::ofstream::binary | std::ofstream::trunc);
+        if (out.fail())
+            return 3; // could not write the backup
+        int status = backup([&](const std::string &chunk) {
+            return bool(out.write(chunk.data(), chunk.size()));
+        });
+        out.close();
+        if (!status && out.fail())
+            status = 3;
+        if (!status) {
+#ifdef _WIN32
+            // rename won't replace an existing file on Windows
+            if (!MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+                status = 3;
+#else
+            // replaces any earlier backup in one go, so there's always a complete one at path
+            if (std::rename(temp_path.c_str(), path.c_str()))
+                status = 3;
+#endif
+        }
+        if (status)
+            std::remove(temp_path.c_str());
+        return status;
+    }
+
+    // Rate limits user's requests (see admission.h): takes a token from the account's bucket,
+    // which is shared by all of its connections
+    bool take_request_token(const account *user, double rate, double burst, token_bucket::clock::time_point now) {
+        if (rate <= 0)
+            return true; // no limit, so no need to lock
+        // a Fibonacci hash of the address, since its low bits are the same for every account
+        uint64_t hash = (uint64_t) reinterpret_cast<uintptr_t>(user) * 0x9E3779B97F4A7C15ULL;
+        rate_shard &shard = rate_shards[(hash >> 32) % RATE_SHARDS];
+        const std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.buckets[user].take(rate, burst, now);
     }
 
     std::string get_quote(unsigned long long parameters[]) {
-        const std::lock_guard<std::mutex> lock(mutex);
+        const std::lock_guard<std::mutex> lock(quote_mutex);
         int seed = (int) parameters[0];
         std::string filename = *((std::string *) parameters[1]);
         std::vector<std::string> quotes;
@@ -127,8 +342,60 @@ public:
     }
 
 private:
+    // A scan_accounts in progress: how many accounts it covers, and the values from when it
+    // started of every account that has changed since (pw_hash, balance)
+    struct scan {
+        size_t end;
+        std::unordered_map<const account *, std::pair<unsigned long long, unsigned long long>> saved;
+    };
+
+    // Called with the mutex held, just before a change to a's password or balance
+    void preserve_for_scans(const account *a) {
+        for (scan *s : scans)
+            s->saved.emplace(a, std::make_pair(a->pw_hash, a->balance)); // keeps the oldest values
+    }
+
+    // Overwrites the password hash and balance on accounts[index]'s line of the data file with
+    // its current ones. The mutex is only held to read them, not for the file I/O.
+    int write_record(size_t index) {
+        const std::lock_guard<std::mutex> file_lock(file_mutex);
+        std::string expected_name;
+        unsigned long long pw_hash, balance;
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            const account::pointer &a = accounts[index];
+            expected_name = a->name;
+            pw_hash = a->pw_hash;
+            balance = a->balance;
+        }
+        std::fstream file(DB_FILE, std::fstream::in | std::fstream::out | std::fstream::binary);
+        std::string garbage;
+        for (size_t j = 0; j < index; j++) {
+            std::getline(file, garbage);
+        }
+        std::string name;
+        if (file >> name && name == expected_name) {
+            file << std::setw(PW_HASH_WIDTH) << pw_hash << std::setw(BALANCE_WIDTH) << balance;
+            file.close();
+            return 0;
+        }
+        file.close();
+        return 2; // error editing account info
+    }
+
     std::vector<account::pointer> accounts;
     std::mutex mutex;
+    std::mutex file_mutex;
+    std::mutex quote_mutex;
+    // Some of the accounts' request token buckets, each on its own cache line so threads using
+    // different shards don't slow each other down
+    struct alignas(64) rate_shard {
+        std::mutex mutex;
+        std::unordered_map<const account *, token_bucket> buckets; // under mutex
+    };
+    rate_shard rate_shards[RATE_SHARDS];
+    std::vector<scan *> scans; // in progress, under the mutex
+    bool backup_running = false;
 };
 
-#endif // DATABASE_H
\ No newline at end of file
+#endif // DATABASE_H
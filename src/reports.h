@@ -0,0 +1,182 @@
+/*
+Reports are totals over every account (sum of balances, top balances, balance histogram) for the
+admin-only request types.
+
+They're computed from a balance_snapshot (see database.h), so every number in a report comes
+from the same point in time. The snapshot is split into chunks that are scanned in parallel on
+the report threads. The sum runs straight over the balances array so the compiler can vectorize
+it; the histogram works out every bucket index in one tight loop and only then counts them, so
+the divisions (shifts when the width is a power of two) aren't held up by the scattered
+increments. Top balances is a heap per chunk, which isn't vectorized but mostly costs one
+comparison per balance.
+*/
+
+#ifndef REPORTS_H
+#define REPORTS_H
+
+#include "asio.hpp"
+#include "database.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <queue>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// chunks smaller than this aren't worth a thread of their own
+#define REPORT_MIN_CHUNK 65536
+// most rows a top balances or histogram report will return
+#define REPORT_MAX_ROWS 1000
+// balances a histogram chunk works out bucket indices for before counting them
+#define HISTOGRAM_BLOCK 1024
+
+// Shared by all connections: who may run reports, where backups go, and the threads they run on
+// so that a big report doesn't hold up the connections on the thread that asked for it
+struct report_service {
+    report_service(std::string admin, std::string backup_dir = "") : admin(admin), backup_dir(backup_dir) {
+    }
+
+    // Whether user (who may be nobody) is the admin
+    bool is_admin(const account *user) const {
+        return user && !admin.empty() && user->name == admin;
+    }
+
+    std::string admin;      // name of the only account allowed to run reports (empty for nobody)
+    std::string backup_dir; // the only directory backups are written to (empty for no backups)
+    asio::thread_pool pool;
+};
+
+// Calls f(begin, end) for chunks covering [0, n) in parallel on pool and returns each chunk's
+// result. The calling thread (usually one of pool's own) takes chunks too and only waits for the
+// ones already running elsewhere, so reports can't deadlock waiting on chunks stuck in the queue
+// behind them.
+template <typename Result, typename Function>
+std::vector<Result> parallel_chunks(asio::thread_pool &pool, size_t n, Function f) {
+    size_t chunks = std::max(1u, std::thread::hardware_concurrency());
+    chunks = std::min(chunks, n / REPORT_MIN_CHUNK + 1);
+    size_t chunk = (n + chunks - 1) / chunks;
+    struct shared_state {
+        std::vector<Result> results;
+        std::atomic<size_t> next{0}; // next chunk nobody has taken yet
+        size_t done = 0;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    std::shared_ptr<shared_state> state = std::make_shared<shared_state>();
+    state->results.resize(chunks);
+    auto work = [state, f, n, chunk, chunks] {
+        for (size_t c; (c = state->next++) < chunks;) {
+            Result result = f(std::min(n, c * chunk), std::min(n, (c + 1) * chunk));
+            const std::lock_guard<std::mutex> lock(state->mutex);
+            state->results[c] = std::move(result);
+            if (++state->done == chunks)
+                state->finished.notify_all();
+        }
+    };
+    for (size_t i = 1; i < chunks; i++)
+        asio::post(pool, work);
+    work();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&] { return state->done == chunks; });
+    return std::move(state->results);
+}
+
+inline unsigned long long sum_balances(asio::thread_pool &pool, const balance_snapshot &snapshot) {
+    const unsigned long long *balances = snapshot.balances.data();
+    std::vector<unsigned long long> sums = parallel_chunks<unsigned long long>(pool, snapshot.balances.size(), [=](size_t begin, size_t end) {
+        unsigned long long sum = 0;
+        for (size_t i = begin; i < end; i++)
+            sum += balances[i];
+        return sum;
+    });
+    return std::accumulate(sums.begin(), sums.end(), 0ULL);
+}
+
+// The n largest balances (largest first), along with whose they are
+inline std::vector<std::pair<unsigned long long, const account *>> top_balances(asio::thread_pool &pool, const balance_snapshot &snapshot, size_t n) {
+    typedef std::pair<unsigned long long, size_t> entry; // balance, index into the snapshot
+    typedef std::priority_queue<entry, std::vector<entry>, std::greater<entry>> min_heap;
+    const unsigned long long *balances = snapshot.balances.data();
+    // each chunk keeps its n largest in a min heap, so most balances only cost one comparison
+    std::vector<std::vector<entry>> chunk_tops = parallel_chunks<std::vector<entry>>(pool, snapshot.balances.size(), [=](size_t begin, size_t end) {
+        min_heap heap;
+        for (size_t i = begin; i < end && n; i++) {
+            if (heap.size() < n)
+                heap.push(entry(balances[i], i));
+            else if (balances[i] > heap.top().first) {
+                heap.pop();
+                heap.push(entry(balances[i], i));
+            }
+        }
+        std::vector<entry> top;
+        for (; !heap.empty(); heap.pop())
+            top.push_back(heap.top());
+        return top;
+    });
+
+    std::vector<entry> all;
+    for (std::vector<entry> &top : chunk_tops)
+        all.insert(all.end(), top.begin(), top.end());
+    n = std::min(n, all.size());
+    std::partial_sort(all.begin(), all.begin() + n, all.end(), std::greater<entry>());
+    std::vector<std::pair<unsigned long long, const account *>> result;
+    for (size_t i = 0; i < n; i++)
+        result.push_back(std::make_pair(all[i].first, snapshot.owners[all[i].second]));
+    return result;
+}
+
+// Number of accounts with balances in [i * width, (i + 1) * width) for each bucket i, except
+// that the last bucket also counts everything above it
+inline std::vector<unsigned long long> balance_histogram(asio::thread_pool &pool, const balance_snapshot &snapshot, unsigned long long width, size_t buckets) {
+    if (!width)
+        width = 1;
+    if (!buckets)
+        return std::vector<unsigned long long>();
+    const unsigned long long *balances = snapshot.balances.data();
+    const unsigned long long last = buckets - 1; // buckets is at most REPORT_MAX_ROWS
+    int shift = -1; // for a power of two width, how far to shift instead of dividing
+    if (!(width & (width - 1)))
+        for (shift = 0; (1ULL << shift) != width; shift++)
+            ;
+    std::vector<std::vector<unsigned long long>> chunk_counts = parallel_chunks<std::vector<unsigned long long>>(pool, snapshot.balances.size(), [=](size_t begin, size_t end) {
+        std::vector<unsigned long long> counts(buckets);
+        uint32_t index[HISTOGRAM_BLOCK];
+        for (size_t block = begin; block < end; block += HISTOGRAM_BLOCK) {
+            size_t size = std::min((size_t) HISTOGRAM_BLOCK, end - block);
+            const unsigned long long *b = balances + block;
+            if (shift >= 0) {
+                for (size_t i = 0; i < size; i++)
+                    index[i] = (uint32_t) std::min(b[i] >> shift, last);
+            } else {
+                for (size_t i = 0; i < size; i++)
+                    index[i] = (uint32_t) std::min(b[i] / width, last);
+            }
+            for (size_t i = 0; i < size; i++)
+                counts[index[i]]++;
+        }
+        return counts;
+    });
+
+    std::vector<unsigned long long> counts(buckets);
+    for (std::vector<unsigned long long> &c : chunk_counts)
+        for (size_t i = 0; i < buckets; i++)
+            counts[i] += c[i];
+    return counts;
+}
+
+// Where histogram bucket i starts, i.e. i * width, but ULLONG_MAX rather than overflowing
+inline unsigned long long histogram_bucket_start(size_t i, unsigned long long width) {
+    if (!width)
+        width = 1;
+    return i > ULLONG_MAX / width ? ULLONG_MAX : i * width;
+}
+
+#endif // REPORTS_H
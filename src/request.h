@@ -6,7 +6,10 @@ Simply a POD data object representing requests.
 #define REQUEST_H
 
 #include "asio.hpp"
+#include <cstring>
+#include <memory>
 #include <string>
+#include <vector>
 
 #define MAX_BODY_LEN 255
 
@@ -22,7 +25,12 @@ enum class request_type {
     deposit,
     withdraw,
     transfer,
-    change_password
+    change_password,
+    get_totals,
+    get_top_balances,
+    get_balance_histogram,
+    backup,
+    busy // sent instead of a response when the server is overloaded (see admission.h)
 };
 
 // Asio read functions require us to know how many bytes to read, so request objects have
@@ -35,17 +43,21 @@ struct request_header {
 struct request {
     request_header header;
     char body[MAX_BODY_LEN + 1];
-    void send(asio::ip::tcp::socket &socket) {
+    // Templates so the same requests go over TCP, Unix domain and generic sockets
+    template <typename Socket>
+    void send(Socket &socket) {
         asio::write(socket, asio::buffer(this, sizeof(request_header) + header.body_size));
     }
-    void async_send(asio::ip::tcp::socket &socket) {
-        asio::async_write(socket, asio::buffer(this, sizeof(request_header) + header.body_size), [](const std::error_code &ec, size_t bytes) {});
+    template <typename Socket>
+    void async_send(Socket &socket) {
+        asio::async_write(socket, asio::buffer(this, sizeof(request_header) + header.body_size), [](const asio::error_code &ec, size_t bytes) {});
     }
 };
 
 // Asio also requires the data we read/write be Plain Old Data (POD) types, so we can't
-// have a custom constructor. Hence the need for this function.
-request new_request(request_type type, std::string body) {
+// have a custom constructor. Hence the need for this function. It's inline since this header
+// is included by every program (and may end up in several translation units of one).
+inline request new_request(request_type type, std::string body) {
     request req;
     req.header.type = type;
     if (body.length() > MAX_BODY_LEN)
@@ -55,4 +67,16 @@ request new_request(request_type type, std::string body) {
     return req;
 }
 
+// Sends several requests back to back in one write, so a multi-part response can't get mixed
+// up with anything else written to the socket. The data is kept alive until the write is done.
+template <typename Socket>
+void async_send_all(Socket &socket, const std::vector<request> &requests) {
+    std::shared_ptr<std::vector<char>> data = std::make_shared<std::vector<char>>();
+    for (const request &req : requests) {
+        const char *begin = (const char *) &req;
+        data->insert(data->end(), begin, begin + sizeof(request_header) + req.header.body_size);
+    }
+    asio::async_write(socket, asio::buffer(*data), [data](const asio::error_code &ec, size_t bytes) {});
+}
+
 #endif // REQUEST_H
\ No newline at end of file
@@ -1,49 +1,306 @@
 #include "account.h"
+#include "admission.h"
 #include "asio.hpp"
 #include "database.h"
+#include "reports.h"
 #include "request.h"
 #include "tcp_connection.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
+#include <sys/stat.h>
 
 using asio::ip::tcp;
 
-// Like tcp_connection, tcp_server accepts incoming connections asynchronously
+typedef asio::basic_socket_acceptor<asio::generic::stream_protocol> generic_acceptor;
+
+#ifdef SO_REUSEPORT
+// Asio has no option for SO_REUSEPORT, so this is one, to pass to set_option like Asio's own
+class reuse_port {
+public:
+    explicit reuse_port(bool enabled) : value(enabled ? 1 : 0) {
+    }
+
+    template <typename Protocol>
+    int level(const Protocol &) const {
+        return SOL_SOCKET;
+    }
+
+    template <typename Protocol>
+    int name(const Protocol &) const {
+        return SO_REUSEPORT;
+    }
+
+    template <typename Protocol>
+    const int *data(const Protocol &) const {
+        return &value;
+    }
+
+    template <typename Protocol>
+    size_t size(const Protocol &) const {
+        return sizeof(value);
+    }
+
+private:
+    int value;
+};
+#endif
+
+// Usage: server [port] [--no-ipv6] [--unix path] [--sndbuf bytes] [--rcvbuf bytes]
+//               [--threads n] [--reuseport] [--accepts n] [--admin account]
+//               [--rate n] [--account-rate n] [--queue n] [--max-wait ms]
+//               [--backup-dir path]
+struct server_options {
+    int port = 4567;
+    bool ipv6 = true;
+    std::string unix_path; // empty means no Unix domain socket
+    int send_buffer = 0;   // socket buffer sizes in bytes, 0 leaves the OS default
+    int receive_buffer = 0;
+    int threads = 1;
+    bool reuse_port = false; // every thread gets its own TCP acceptors instead of sharing one set
+    int accepts = 1;         // outstanding async_accepts per acceptor
+    std::string admin;       // account allowed to run reports (see reports.h)
+    std::string backup_dir;  // where the admin's backups go (see backup.h), empty for no backups
+    admission_settings admission;
+};
+
+// Like tcp_connection, tcp_server accepts incoming connections asynchronously. It listens on
+// IPv4, IPv6 and (where supported) a Unix domain socket at once, and every acceptor hands its
+// connections to the same tcp_connection handler.
+//
+// Each thread runs its own io_context (a "worker"), and a connection stays on the worker whose
+// io_context its socket was created on. Normally the acceptors all live on the first worker and
+// deal new connections out to the workers in turn. With reuse_port, every worker binds its own
+// TCP acceptors with SO_REUSEPORT so the kernel spreads incoming connections (and the cost of
+// accepting them) across the threads.
 class tcp_server {
 public:
-    tcp_server(asio::io_context &io_context, int port) : io_context_(io_context), acceptor_(io_context, tcp::endpoint(tcp::v4(), port)) {
-        start_accept();
+    tcp_server(const server_options &options) : options_(options), workers_(make_workers(options.threads, options.admission)), signals_(workers_.front()->io_context, SIGINT, SIGTERM), reports_(options.admin, options.backup_dir) {
+        // the admin has to be registered already, otherwise the first client to register the name would be it
+        if (!options.admin.empty() && !db.has_account(options.admin))
+            throw std::runtime_error("The admin account " + options.admin + " doesn't exist. Register it before starting the server with --admin.");
+        if (!options.backup_dir.empty())
+            check_backup_dir(options.backup_dir);
+#ifndef SO_REUSEPORT
+        if (options_.reuse_port) {
+            std::cerr << "SO_REUSEPORT isn't supported on this platform" << std::endl;
+            options_.reuse_port = false;
+        }
+#endif
+        for (std::unique_ptr<worker> &w : workers_) {
+            if (w != workers_.front() && !options_.reuse_port)
+                break;
+            listen(*w, tcp::endpoint(tcp::v4(), options.port), true);
+            if (options.ipv6) {
+                try {
+                    listen(*w, tcp::endpoint(tcp::v6(), options.port), true);
+                } catch (std::exception &e) {
+                    std::cerr << "Not listening on IPv6: " << e.what() << std::endl;
+                }
+            }
+        }
+        if (!options.unix_path.empty()) {
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+            remove_socket_file(options.unix_path); // left behind if the last server didn't exit cleanly
+            listen(*workers_.front(), asio::local::stream_protocol::endpoint(options.unix_path), false);
+#else
+            std::cerr << "Unix domain sockets aren't supported on this platform" << std::endl;
+#endif
+        }
+
+        // exit normally on Ctrl+C so destructors (and PGO profile dumps) still run
+        signals_.async_wait([this](const asio::error_code &ec, int signal) {
+            for (std::unique_ptr<worker> &w : workers_)
+                w->io_context.stop();
+        });
+    }
+
+    ~tcp_server() {
+        if (!options_.unix_path.empty())
+            remove_socket_file(options_.unix_path);
+    }
+
+    // Runs the first worker on the calling thread and the rest on their own threads
+    void run() {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers_.size(); i++)
+            threads.emplace_back([this, i] { workers_[i]->io_context.run(); });
+        workers_.front()->io_context.run();
+        for (std::thread &t : threads)
+            t.join();
     }
 
 private:
-    void start_accept() {
-        tcp_connection::pointer new_connection = tcp_connection::create(io_context_, db);
-        acceptor_.async_accept(new_connection->socket(), std::bind(&tcp_server::handle_accept, this, new_connection, std::placeholders::_1));
+    struct worker {
+        worker(const admission_settings &settings) : work(asio::make_work_guard(io_context)), admission(io_context, settings) {
+        }
+        asio::io_context io_context;
+        // keeps run() going on workers that have connections but no acceptors of their own
+        asio::executor_work_guard<asio::io_context::executor_type> work;
+        admission_control admission; // priority lanes for this worker's connections
+    };
+
+    struct listener {
+        listener(worker &owner, bool tcp) : owner(owner), acceptor(owner.io_context), tcp(tcp) {
+        }
+        worker &owner;
+        generic_acceptor acceptor;
+        bool tcp; // TCP options don't apply to Unix domain sockets
+    };
+
+    // Deletes path only if it's a Unix domain socket, so a mistyped --unix can't delete some
+    // other file. Anything else is left alone (and then makes the bind fail).
+    static void remove_socket_file(const std::string &path) {
+#if defined(ASIO_HAS_LOCAL_SOCKETS) && defined(S_ISSOCK)
+        struct stat info;
+        if (!lstat(path.c_str(), &info) && S_ISSOCK(info.st_mode))
+            std::remove(path.c_str());
+#endif
+    }
+
+    // Backups go in their own directory, so that one can't replace accounts.db (or quotes.txt)
+    static void check_backup_dir(const std::string &dir) {
+        struct stat info;
+        if (stat(dir.c_str(), &info) || !(info.st_mode & S_IFDIR))
+            throw std::runtime_error("--backup-dir " + dir + " isn't a directory");
+#ifdef _WIN32
+        char full[_MAX_PATH], working[_MAX_PATH];
+        bool same = _fullpath(full, dir.c_str(), _MAX_PATH) && _fullpath(working, ".", _MAX_PATH) && !_stricmp(full, working);
+#else
+        char *full = realpath(dir.c_str(), nullptr);
+        char *working = realpath(".", nullptr);
+        bool same = full && working && !strcmp(full, working);
+        free(full);
+        free(working);
+#endif
+        if (same)
+            throw std::runtime_error("--backup-dir can't be the server's own directory, where accounts.db is");
+    }
+
+    static std::vector<std::unique_ptr<worker>> make_workers(int threads, const admission_settings &settings) {
+        std::vector<std::unique_ptr<worker>> workers;
+        for (int i = 0; i < std::max(1, threads); i++)
+            workers.emplace_back(new worker(settings));
+        return workers;
+    }
+
+    void listen(worker &w, const asio::generic::stream_protocol::endpoint &endpoint, bool is_tcp) {
+        std::unique_ptr<listener> l(new listener(w, is_tcp));
+        l->acceptor.open(endpoint.protocol());
+        if (is_tcp) {
+            l->acceptor.set_option(asio::socket_base::reuse_address(true));
+#ifdef SO_REUSEPORT
+            if (options_.reuse_port)
+                l->acceptor.set_option(reuse_port(true));
+#endif
+            // keep IPv6 from also claiming the IPv4 port, which the IPv4 acceptor already has
+            if (endpoint.protocol().family() == AF_INET6)
+                l->acceptor.set_option(asio::ip::v6_only(true));
+        }
+        // set on the listening socket too, since the TCP window scale is fixed during the handshake
+        asio::error_code ec;
+        set_buffer_sizes(l->acceptor, ec);
+        if (ec)
+            throw asio::system_error(ec);
+        l->acceptor.bind(endpoint);
+        l->acceptor.listen();
+        listeners_.push_back(std::move(l));
+        // a few accepts in flight so a burst of connections doesn't wait on one handler at a time
+        for (int i = 0; i < std::max(1, options_.accepts); i++)
+            start_accept(*listeners_.back());
     }
 
-    void handle_accept(tcp_connection::pointer new_connection, const std::error_code &error) {
-        if (!error)
-            new_connection->start();
-        start_accept();
+    template <typename Socket>
+    void set_buffer_sizes(Socket &socket, asio::error_code &ec) {
+        if (options_.send_buffer > 0)
+            socket.set_option(asio::socket_base::send_buffer_size(options_.send_buffer), ec);
+        if (options_.receive_buffer > 0 && !ec)
+            socket.set_option(asio::socket_base::receive_buffer_size(options_.receive_buffer), ec);
     }
 
-    asio::io_context &io_context_;
-    tcp::acceptor acceptor_;
+    void start_accept(listener &l) {
+        // TCP acceptors with their own SO_REUSEPORT socket per worker keep connections on that worker
+        worker *w = &l.owner;
+        if (!(l.tcp && options_.reuse_port)) {
+            // only ever touched by handlers on the first worker, which owns all shared acceptors
+            w = workers_[next_worker_].get();
+            next_worker_ = (next_worker_ + 1) % workers_.size();
+        }
+        tcp_connection::pointer new_connection = tcp_connection::create(w->io_context, db, reports_, w->admission);
+        l.acceptor.async_accept(new_connection->socket(), std::bind(&tcp_server::handle_accept, this, std::ref(l), new_connection, std::placeholders::_1));
+    }
+
+    void handle_accept(listener &l, tcp_connection::pointer new_connection, const asio::error_code &error) {
+        if (error == asio::error::operation_aborted)
+            return; // acceptor closed, the server is shutting down
+        if (!error) {
+            asio::error_code ec; // a client that already hung up shouldn't take down the server
+            if (l.tcp)
+                new_connection->socket().set_option(tcp::no_delay(true), ec);
+            if (!ec)
+                set_buffer_sizes(new_connection->socket(), ec);
+            // run the connection on its own worker's thread
+            asio::post(new_connection->socket().get_executor(), std::bind(&tcp_connection::start, new_connection));
+        }
+        start_accept(l);
+    }
+
+    server_options options_;
     database db;
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::vector<std::unique_ptr<listener>> listeners_;
+    asio::signal_set signals_;
+    size_t next_worker_ = 0;
+    // last, so its threads are finished before the workers they post responses to are destroyed
+    report_service reports_;
 };
 
 int main(int argc, char **argv) {
     try {
-        int port = 4567;
-        if (argc > 1) {
-            port = atoi(argv[1]); // Careful! No safeguards here
+        server_options options;
+        for (int i = 1; i < argc; i++) {
+            if (!strcmp(argv[i], "--no-ipv6"))
+                options.ipv6 = false;
+            else if (!strcmp(argv[i], "--unix") && i + 1 < argc)
+                options.unix_path = argv[++i];
+            else if (!strcmp(argv[i], "--sndbuf") && i + 1 < argc)
+                options.send_buffer = atoi(argv[++i]);
+            else if (!strcmp(argv[i], "--rcvbuf") && i + 1 < argc)
+                options.receive_buffer = atoi(argv[++i]);
+            else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+                options.threads = std::max(1, atoi(argv[++i]));
+            else if (!strcmp(argv[i], "--reuseport"))
+                options.reuse_port = true;
+            else if (!strcmp(argv[i], "--accepts") && i + 1 < argc)
+                options.accepts = atoi(argv[++i]);
+            else if (!strcmp(argv[i], "--admin") && i + 1 < argc)
+                options.admin = argv[++i];
+            else if (!strcmp(argv[i], "--rate") && i + 1 < argc)
+                options.admission.connection_rate = atof(argv[++i]);
+            else if (!strcmp(argv[i], "--account-rate") && i + 1 < argc)
+                options.admission.account_rate = atof(argv[++i]);
+            else if (!strcmp(argv[i], "--queue") && i + 1 < argc)
+                options.admission.queue_limit = std::max(1, atoi(argv[++i]));
+            else if (!strcmp(argv[i], "--backup-dir") && i + 1 < argc)
+                options.backup_dir = argv[++i];
+            else if (!strcmp(argv[i], "--max-wait") && i + 1 < argc)
+                options.admission.max_wait = std::chrono::milliseconds(std::max(0, atoi(argv[++i])));
+            else
+                options.port = atoi(argv[i]); // Careful! No safeguards here
         }
-        asio::io_context io_context;
-        tcp_server server(io_context, port);
-        io_context.run();
+        tcp_server server(options);
+        server.run();
     } catch (std::exception &e) {
         std::cerr << e.what() << std::endl;
+        return 1;
     }
 }
@@ -22,10 +22,14 @@ think of this as a kind of informal loop.
 #define TCP_CONNECTION_H
 
 #include "asio.hpp"
+#include "admission.h"
+#include "backup.h"
 #include "database.h"
+#include "reports.h"
 #include "request.h"
 #include <functional>
 #include <iostream>
+#include <sstream>
 
 using asio::ip::tcp;
 
@@ -33,11 +37,15 @@ class tcp_connection : public std::enable_shared_from_this<tcp_connection> {
 public:
     typedef std::shared_ptr<tcp_connection> pointer;
 
-    static pointer create(asio::io_context &io_context, database &db) {
-        return pointer(new tcp_connection(io_context, db));
+    // A generic stream socket, so connections accepted over IPv4, IPv6 and Unix domain sockets
+    // are all handled by this same class
+    typedef asio::generic::stream_protocol::socket socket_type;
+
+    static pointer create(asio::io_context &io_context, database &db, report_service &reports, admission_control &admission) {
+        return pointer(new tcp_connection(io_context, db, reports, admission));
     }
 
-    tcp::socket &socket() {
+    socket_type &socket() {
         return socket_;
     }
 
@@ -46,14 +54,14 @@ public:
     }
 
 private:
-    tcp_connection(asio::io_context &io_context, database &db) : socket_(io_context), db(db) {
+    tcp_connection(asio::io_context &io_context, database &db, report_service &reports, admission_control &admission) : socket_(io_context), db(db), reports(reports), admission(admission) {
     }
 
     void read_header() {
         asio::async_read(socket_, asio::buffer(&req.header, sizeof(request_header)), std::bind(&tcp_connection::read_body, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
     }
 
-    void read_body(const std::error_code &ec, size_t bytes) {
+    void read_body(const asio::error_code &ec, size_t bytes) {
         if (asio::error::eof == ec || asio::error::connection_reset == ec) {
             // handle disconnect
             close();
@@ -62,118 +70,214 @@ private:
         }
     }
 
-    void handle_request(const std::error_code &ec, size_t bytes) {
+    void handle_request(const asio::error_code &ec, size_t bytes) {
         if (asio::error::eof == ec || asio::error::connection_reset == ec) {
             // handle disconnect
             close();
         } else {
-            // handle request
-            req_scanner = std::stringstream(req.body);
-            switch (req.header.type) {
-            case request_type::register_account: {
-                std::string name;
-                unsigned long long pw_hash;
-                req_scanner >> name >> pw_hash;
-                user = db.register_account(name, pw_hash);
-                new_request(request_type::response, user ? "0" : "1").async_send(socket_);
-                break;
+            admit();
+        }
+    }
+
+    // Rate limits the request, then queues it in its priority lane (see admission.h). Requests
+    // that are turned away get a busy instead of a response.
+    void admit() {
+        request_type type = req.header.type;
+        if (!is_answered(type, bool(user))) {
+            // the client wouldn't know it was turned away, so it isn't limited or shed at all
+            admission.submit(classify(type), std::bind(&tcp_connection::handle_admitted, shared_from_this(), std::placeholders::_1), true);
+            return;
+        }
+        const admission_settings &settings = admission.settings();
+        token_bucket::clock::time_point now = token_bucket::clock::now();
+        bool allowed = requests.take(settings.connection_rate, std::max(1.0, settings.connection_rate), now);
+        if (allowed && user)
+            allowed = db.take_request_token(user.get(), settings.account_rate, std::max(1.0, settings.account_rate), now);
+        if (!allowed || !admission.submit(classify(type), std::bind(&tcp_connection::handle_admitted, shared_from_this(), std::placeholders::_1)))
+            handle_admitted(true);
+    }
+
+    // The request's turn in its lane, unless the server is too busy for it
+    void handle_admitted(bool busy) {
+        if (!busy) {
+            process_request();
+            return;
+        }
+        new_request(request_type::busy, "").async_send(socket_);
+        read_header();
+    }
+
+    void process_request() {
+        // handle request
+        req_scanner = std::stringstream(req.body);
+        switch (req.header.type) {
+        case request_type::register_account: {
+            std::string name;
+            unsigned long long pw_hash;
+            req_scanner >> name >> pw_hash;
+            user = db.register_account(name, pw_hash);
+            new_request(request_type::response, user ? "0" : "1").async_send(socket_);
+            break;
+        }
+        case request_type::login: {
+            std::string name;
+            unsigned long long pw_hash;
+            req_scanner >> name >> pw_hash;
+            user = db.get_account(name, pw_hash);
+            std::string error = user ? "0" : "1";
+            if (user.use_count() > 2) {
+                error = "2";
+                user.reset();
+            }
+            new_request(request_type::response, error).async_send(socket_);
+            break;
+        }
+        case request_type::logout:
+            if (user) {
+                db.commit_updates(user);
+                user.reset();
+            }
+            break;
+        case request_type::get_balance:
+            if (user) {
+                new_request(request_type::response, std::to_string(user->balance)).async_send(socket_);
+            }
+            break;
+        case request_type::get_id:
+            if (user) {
+                new_request(request_type::response, std::to_string((unsigned long long) &(user->name))).async_send(socket_);
             }
-            case request_type::login: {
+            break;
+        case request_type::get_quote:
+            if (user) {
+                // get quote
+                unsigned long long parameters[2];
+                std::string filename = "quotes.txt";
+                parameters[1] = (unsigned long long) &filename;
+                unsigned long long seed, i = 0;
+                while (req_scanner >> seed)
+                    parameters[i++] = seed;
+                std::string quote = db.get_quote(parameters);
+                new_request(request_type::response, quote).async_send(socket_);
+            }
+            break;
+        case request_type::deposit:
+            if (user) {
+                unsigned long long amount;
+                req_scanner >> amount;
+                new_request(request_type::response, std::to_string(db.deposit(user, amount))).async_send(socket_);
+            }
+            break;
+        case request_type::withdraw:
+            if (user) {
+                unsigned long long amount;
+                req_scanner >> amount;
+                std::string error = std::to_string(db.withdraw(user, amount));
+                new_request(request_type::response, error + " " + std::to_string(user->balance)).async_send(socket_);
+            }
+            break;
+        case request_type::transfer:
+            if (user) {
                 std::string name;
-                unsigned long long pw_hash;
-                req_scanner >> name >> pw_hash;
-                user = db.get_account(name, pw_hash);
-                std::string error = user ? "0" : "1";
-                if (user.use_count() > 2) {
-                    error = "2";
-                    user.reset();
-                }
+                unsigned long long amount;
+                req_scanner >> name >> amount;
+                std::string error = std::to_string(db.transfer(user, name, amount));
+                new_request(request_type::response, error + " " + std::to_string(user->balance)).async_send(socket_);
+            }
+            break;
+        case request_type::change_password:
+            if (user) {
+                unsigned long long old_pw, new_pw;
+                req_scanner >> old_pw >> new_pw;
+                std::string error = std::to_string(db.change_password(user, old_pw, new_pw));
                 new_request(request_type::response, error).async_send(socket_);
-                break;
             }
-            case request_type::logout:
-                if (user) {
-                    db.commit_updates(user);
-                    user.reset();
-                }
-                break;
-            case request_type::get_balance:
-                if (user) {
-                    new_request(request_type::response, std::to_string(user->balance)).async_send(socket_);
-                }
-                break;
-            case request_type::get_id:
-                if (user) {
-                    new_request(request_type::response, std::to_string((unsigned long long) &(user->name))).async_send(socket_);
-                }
-                break;
-            case request_type::get_quote:
-                if (user) {
-                    // get quote
-                    unsigned long long parameters[2];
-                    std::string filename = "quotes.txt";
-                    parameters[1] = (unsigned long long) &filename;
-                    unsigned long long seed, i = 0;
-                    while (req_scanner >> seed)
-                        parameters[i++] = seed;
-                    std::string quote = db.get_quote(parameters);
-                    new_request(request_type::response, quote).async_send(socket_);
-                }
-                break;
-            case request_type::deposit:
-                if (user) {
-                    unsigned long long amount;
-                    req_scanner >> amount;
-                    user->balance += amount;
-                    new_request(request_type::response, std::to_string(user->balance)).async_send(socket_);
-                }
-                break;
-            case request_type::withdraw:
-                if (user) {
-                    unsigned long long amount;
-                    req_scanner >> amount;
-                    std::string error = "0";
-                    if (amount <= user->balance)
-                        user->balance -= amount;
-                    else
-                        error = "1";
-                    new_request(request_type::response, error + " " + std::to_string(user->balance)).async_send(socket_);
-                }
-                break;
-            case request_type::transfer:
-                if (user) {
-                    std::string name;
-                    unsigned long long amount;
-                    req_scanner >> name >> amount;
-                    std::string error = "0";
-                    if (amount <= user->balance) {
-                        int db_status = db.transfer(name, amount);
-                        if (!db_status)
-                            user->balance -= amount;
-                        else
-                            error = std::to_string(db_status);
-                    } else {
-                        error = "1";
-                    }
-                    new_request(request_type::response, error + " " + std::to_string(user->balance)).async_send(socket_);
-                }
-                break;
-            case request_type::change_password:
-                if (user) {
-                    unsigned long long old_pw, new_pw;
-                    req_scanner >> old_pw >> new_pw;
-                    std::string error = "0";
-                    if (old_pw == user->pw_hash)
-                        user->pw_hash = new_pw;
-                    else
-                        error = "1";
-                    new_request(request_type::response, error).async_send(socket_);
-                }
-                break;
+            break;
+        case request_type::get_totals:
+            if (is_admin()) {
+                run_report([](asio::thread_pool &pool, const balance_snapshot &snapshot) {
+                    std::string totals = std::to_string(snapshot.balances.size()) + " " + std::to_string(sum_balances(pool, snapshot));
+                    return std::vector<request>{new_request(request_type::response, "0 " + totals)};
+                });
+                return; // run_report goes back to reading requests once the report is sent
             }
-
-            read_header();
+            new_request(request_type::response, "1").async_send(socket_);
+            break;
+        case request_type::get_top_balances:
+            if (is_admin()) {
+                size_t n = 0;
+                req_scanner >> n;
+                n = std::min(n, (size_t) REPORT_MAX_ROWS);
+                run_report([n](asio::thread_pool &pool, const balance_snapshot &snapshot) {
+                    std::vector<std::pair<unsigned long long, const account *>> top = top_balances(pool, snapshot, n);
+                    std::vector<request> responses{new_request(request_type::response, "0 " + std::to_string(top.size()))};
+                    for (std::pair<unsigned long long, const account *> &t : top)
+                        responses.push_back(new_request(request_type::response, t.second->name + " " + std::to_string(t.first)));
+                    return responses;
+                });
+                return;
+            }
+            new_request(request_type::response, "1").async_send(socket_);
+            break;
+        case request_type::get_balance_histogram:
+            if (is_admin()) {
+                unsigned long long width = 0;
+                size_t buckets = 0;
+                req_scanner >> width >> buckets;
+                buckets = std::min(buckets, (size_t) REPORT_MAX_ROWS);
+                run_report([width, buckets](asio::thread_pool &pool, const balance_snapshot &snapshot) {
+                    std::vector<unsigned long long> counts = balance_histogram(pool, snapshot, width, buckets);
+                    std::vector<request> responses{new_request(request_type::response, "0 " + std::to_string(counts.size()))};
+                    for (size_t i = 0; i < counts.size(); i++)
+                        responses.push_back(new_request(request_type::response, std::to_string(histogram_bucket_start(i, width)) + " " + std::to_string(counts[i])));
+                    return responses;
+                });
+                return;
+            }
+            new_request(request_type::response, "1").async_send(socket_);
+            break;
+        case request_type::backup:
+            if (is_admin()) {
+                std::string target;
+                req_scanner >> target;
+                run_in_background([this, target] {
+                    return std::vector<request>{new_request(request_type::response, std::to_string(run_backup(db, reports.backup_dir, target)))};
+                });
+                return;
+            }
+            new_request(request_type::response, "1").async_send(socket_);
+            break;
         }
+
+        read_header();
+    }
+
+    bool is_admin() {
+        return reports.is_admin(user.get());
+    }
+
+    // Snapshots the balances and computes the report in the background (the report can use the
+    // report threads too). Neither holds up the other connections much, since the snapshot only
+    // locks the database a batch at a time.
+    void run_report(std::function<std::vector<request>(asio::thread_pool &, const balance_snapshot &)> report) {
+        database &db = this->db;
+        asio::thread_pool &pool = reports.pool;
+        run_in_background([&db, &pool, report] {
+            return report(pool, db.snapshot_balances());
+        });
+    }
+
+    // Runs task on the report threads and sends the responses it returns from this connection's
+    // thread. Reading the next request waits until then, so responses stay in order.
+    void run_in_background(std::function<std::vector<request>()> task) {
+        pointer self = shared_from_this();
+        asio::post(reports.pool, [self, task] {
+            std::shared_ptr<std::vector<request>> responses = std::make_shared<std::vector<request>>(task());
+            asio::post(self->socket_.get_executor(), [self, responses] {
+                async_send_all(self->socket_, *responses);
+                self->read_header();
+            });
+        });
     }
 
     void close() {
@@ -185,8 +289,11 @@ private:
         shared_from_this().reset();
     }
 
-    tcp::socket socket_;
+    socket_type socket_;
     database &db;
+    report_service &reports;
+    admission_control &admission; // this connection's worker's
+    token_bucket requests;        // rate limit for this connection
     request req;
     std::stringstream req_scanner;
 
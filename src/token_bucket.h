@@ -0,0 +1,39 @@
+/*
+A token bucket for rate limiting: it fills at rate tokens per second up to burst tokens, and
+every request takes one. The rate and burst are passed in rather than stored, so buckets stay
+small enough to keep one in every connection and every account.
+*/
+
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <algorithm>
+#include <chrono>
+
+class token_bucket {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    // Takes a token if there is one. A rate of 0 means no limit.
+    bool take(double rate, double burst, clock::time_point now) {
+        if (rate <= 0)
+            return true;
+        if (tokens < 0) {
+            tokens = burst; // start full
+        } else {
+            double seconds = std::chrono::duration<double>(now - last).count();
+            tokens = std::min(burst, tokens + rate * seconds);
+        }
+        last = now;
+        if (tokens < 1)
+            return false;
+        tokens -= 1;
+        return true;
+    }
+
+private:
+    double tokens = -1; // negative until the first take
+    clock::time_point last;
+};
+
+#endif // TOKEN_BUCKET_H
@@ -0,0 +1,115 @@
+#include "admission.h"
+#include "check.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+void test_classify() {
+    CHECK(classify(request_type::deposit) == lane::money);
+    CHECK(classify(request_type::transfer) == lane::money);
+    CHECK(classify(request_type::login) == lane::session);
+    CHECK(classify(request_type::change_password) == lane::session);
+    CHECK(classify(request_type::get_balance) == lane::info);
+    CHECK(classify(request_type::get_quote) == lane::info);
+    CHECK(classify(request_type::get_totals) == lane::info);
+}
+
+void test_is_answered() {
+    CHECK(is_answered(request_type::login, false));
+    CHECK(is_answered(request_type::register_account, false));
+    CHECK(is_answered(request_type::get_totals, false)); // answered with "not allowed"
+    CHECK(is_answered(request_type::deposit, true));
+    CHECK(!is_answered(request_type::deposit, false));
+    CHECK(!is_answered(request_type::get_balance, false));
+    CHECK(!is_answered(request_type::logout, true));
+    CHECK(!is_answered(request_type::busy, true));
+}
+
+// Records the order tasks ran in, with a ! for the ones told to answer busy
+struct recorder {
+    std::function<void(bool)> task(std::string name) {
+        return [this, name](bool busy) { order += (order.empty() ? "" : " ") + name + (busy ? "!" : ""); };
+    }
+    std::string order;
+};
+
+void test_priority() {
+    asio::io_context io_context;
+    admission_control admission(io_context, admission_settings());
+    recorder r;
+    admission.submit(lane::info, r.task("quote"));
+    admission.submit(lane::session, r.task("login"));
+    admission.submit(lane::money, r.task("deposit"));
+    admission.submit(lane::info, r.task("balance"));
+    io_context.run();
+    CHECK(r.order == "deposit login quote balance");
+}
+
+void test_queue_limit() {
+    asio::io_context io_context;
+    admission_settings settings;
+    settings.queue_limit = 2;
+    admission_control admission(io_context, settings);
+    recorder r;
+    CHECK(admission.submit(lane::info, r.task("a")));
+    CHECK(admission.submit(lane::info, r.task("b")));
+    CHECK(!admission.submit(lane::info, r.task("c")));
+    CHECK(admission.submit(lane::info, r.task("forced"), true));
+    CHECK(admission.submit(lane::money, r.task("d"))); // other lanes have their own room
+    io_context.run();
+    CHECK(r.order == "d a b forced");
+}
+
+// Requests that waited longer than max_wait are answered busy, unless forced
+void test_max_wait() {
+    asio::io_context io_context;
+    admission_settings settings;
+    settings.max_wait = std::chrono::milliseconds(50);
+    admission_control admission(io_context, settings);
+    recorder r;
+    admission.submit(lane::money, [&](bool busy) {
+        r.task("slow")(busy);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100)); // holds up everything queued behind it
+    });
+    admission.submit(lane::money, r.task("deposit"));
+    admission.submit(lane::session, r.task("logout"), true);
+    admission.submit(lane::info, r.task("quote"));
+    io_context.run();
+    CHECK(r.order == "slow deposit! logout quote!");
+
+    // no limit at all with a max_wait of 0
+    settings.max_wait = admission_settings::clock::duration::zero();
+    admission_control unlimited(io_context, settings);
+    r.order.clear();
+    unlimited.submit(lane::info, r.task("quote"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    unlimited.submit(lane::money, r.task("deposit"));
+    io_context.restart();
+    io_context.run();
+    CHECK(r.order == "deposit quote");
+}
+
+// A lower lane that has waited over half of max_wait goes ahead of the lanes above it
+void test_aging() {
+    asio::io_context io_context;
+    admission_settings settings;
+    settings.max_wait = std::chrono::milliseconds(200);
+    admission_control admission(io_context, settings);
+    recorder r;
+    admission.submit(lane::info, r.task("quote"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(120));
+    admission.submit(lane::money, r.task("deposit"));
+    io_context.run();
+    CHECK(r.order == "quote deposit");
+}
+
+int main() {
+    test_classify();
+    test_is_answered();
+    test_priority();
+    test_queue_limit();
+    test_max_wait();
+    test_aging();
+    return check_result();
+}
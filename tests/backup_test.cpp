@@ -0,0 +1,96 @@
+#include "backup.h"
+#include "check.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <thread>
+
+// the tests' backup directory is their working directory (the server wouldn't allow that)
+#define BACKUP_DIR "."
+#define SOCKET_NAME "backup.sock"
+
+void write_data_file(int accounts) {
+    std::ofstream out(DB_FILE, std::ofstream::trunc);
+    for (int i = 0; i < accounts; i++)
+        out << std::setw(NAME_WIDTH) << "user" + std::to_string(i) << std::setw(PW_HASH_WIDTH) << i << std::setw(BALANCE_WIDTH) << i << std::endl;
+}
+
+void test_backup_names() {
+    CHECK(is_backup_name("backup.db"));
+    CHECK(is_backup_name("..backup"));
+    CHECK(!is_backup_name(""));
+    CHECK(!is_backup_name("."));
+    CHECK(!is_backup_name(".."));
+    CHECK(!is_backup_name("../escaped.db"));
+    CHECK(!is_backup_name("/tmp/escaped.db"));
+    CHECK(!is_backup_name("dir/backup.db"));
+    CHECK(!is_backup_name("dir\\backup.db"));
+    CHECK(!is_backup_name("C:backup.db"));
+}
+
+// Backups only ever go to plain names in the backup directory
+void test_backup_to_file() {
+    write_data_file(3);
+    database db;
+    std::remove("../escaped.db");
+    CHECK(run_backup(db, BACKUP_DIR, "../escaped.db") == 4);
+    CHECK(!std::ifstream("../escaped.db"));
+    CHECK(run_backup(db, BACKUP_DIR, "unix:../escaped.sock") == 4);
+    CHECK(run_backup(db, BACKUP_DIR, "unix:") == 4);
+    CHECK(run_backup(db, "", "backup.db") == 4); // no backup directory, no backups
+    CHECK(run_backup(db, BACKUP_DIR, "backup.db") == 0);
+    std::ifstream in(BACKUP_DIR "/backup.db");
+    std::string name;
+    CHECK(in >> name && name == "user0");
+}
+
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+
+void test_backup_to_socket() {
+    write_data_file(10);
+    database db;
+    asio::io_context io_context;
+    std::remove(SOCKET_NAME);
+    asio::local::stream_protocol::acceptor acceptor(io_context, asio::local::stream_protocol::endpoint(SOCKET_NAME));
+    std::string received;
+    std::thread receiver([&] {
+        asio::local::stream_protocol::socket socket(io_context);
+        acceptor.accept(socket);
+        asio::error_code ec;
+        asio::read(socket, asio::dynamic_buffer(received), ec); // until the backup closes the connection
+    });
+    CHECK(run_backup(db, BACKUP_DIR, "unix:" SOCKET_NAME) == 0);
+    receiver.join();
+    CHECK(received.size() == 10 * (NAME_WIDTH + PW_HASH_WIDTH + BALANCE_WIDTH + 1));
+    CHECK(run_backup(db, BACKUP_DIR, "unix:nobody-listening.sock") == 3);
+}
+
+// A receiver that stops reading (of a backup bigger than a socket can buffer) fails the backup after the timeout instead of blocking it forever
+void test_backup_to_stalled_socket() {
+    write_data_file(50000);
+    database db;
+    asio::io_context io_context;
+    std::remove(SOCKET_NAME);
+    asio::local::stream_protocol::acceptor acceptor(io_context, asio::local::stream_protocol::endpoint(SOCKET_NAME));
+    asio::local::stream_protocol::socket stalled(io_context);
+    std::thread receiver([&] { acceptor.accept(stalled); }); // and then never reads
+    auto start = std::chrono::steady_clock::now();
+    CHECK(run_backup(db, BACKUP_DIR, "unix:" SOCKET_NAME, std::chrono::milliseconds(200)) == 3);
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    receiver.join();
+    CHECK(db.backup([](const std::string &) { return true; }) == 0); // the stalled one is finished
+    std::remove(SOCKET_NAME);
+}
+#endif
+
+int main() {
+    test_backup_names();
+    test_backup_to_file();
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+    test_backup_to_socket();
+    test_backup_to_stalled_socket();
+#endif
+    return check_result();
+}
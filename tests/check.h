@@ -0,0 +1,27 @@
+/*
+Just enough of a test framework for the unit tests: CHECK records a failure (with where it
+happened) and carries on, and main returns check_result() so ctest sees whether anything failed.
+*/
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <iostream>
+
+static int check_failures = 0;
+
+#define CHECK(condition)                                                                     \
+    do {                                                                                     \
+        if (!(condition)) {                                                                  \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed\n"; \
+            check_failures++;                                                                \
+        }                                                                                    \
+    } while (0)
+
+inline int check_result() {
+    if (check_failures)
+        std::cerr << check_failures << " check(s) failed" << std::endl;
+    return check_failures ? 1 : 0;
+}
+
+#endif // CHECK_H
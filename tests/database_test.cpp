@@ -0,0 +1,222 @@
+#include "check.h"
+#include "database.h"
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// Every test starts from an empty data file in the working directory
+void fresh_data_file() {
+    std::remove(DB_FILE);
+}
+
+unsigned long long balance_on_disk(std::string name) {
+    std::ifstream in(DB_FILE);
+    std::string n;
+    unsigned long long pw_hash, balance;
+    while (in >> n >> pw_hash >> balance)
+        if (n == name)
+            return balance;
+    return -1;
+}
+
+void test_transfer() {
+    fresh_data_file();
+    database db;
+    account::pointer from = db.register_account("alice", 1);
+    db.register_account("bob", 2); // not kept, so bob isn't logged in
+    db.deposit(from, 100);
+    CHECK(db.transfer(from, "bob", 500) == 1);
+    CHECK(db.transfer(from, "nobody", 10) == 2);
+    CHECK(db.transfer(from, "bob", 30) == 0);
+    CHECK(from->balance == 70);
+    CHECK(db.get_account("bob", 2)->balance == 30);
+    CHECK(balance_on_disk("bob") == 30); // written right away, since bob isn't logged in
+
+    account::pointer bob = db.get_account("bob", 2);
+    CHECK(db.transfer(from, "bob", 10) == 3);
+    CHECK(from->balance == 70);
+}
+
+// If the destination's record can't be written, the transfer is undone
+void test_transfer_rolls_back() {
+    fresh_data_file();
+    database db;
+    account::pointer from = db.register_account("alice", 1);
+    db.register_account("bob", 2);
+    db.deposit(from, 100);
+    std::ofstream(DB_FILE, std::ofstream::trunc) << "somebody else's file\n";
+    CHECK(db.transfer(from, "bob", 30) == 4);
+    CHECK(from->balance == 100);
+    CHECK(db.get_account("bob", 2)->balance == 0);
+    CHECK(db.snapshot_balances().balances == std::vector<unsigned long long>({100, 0}));
+}
+
+void test_has_account() {
+    fresh_data_file();
+    database db;
+    CHECK(!db.has_account("boss"));
+    db.register_account("boss", 1);
+    CHECK(db.has_account("boss"));
+    CHECK(!db.has_account("bos"));
+    CHECK(!db.register_account("boss", 2)); // so nobody else can take the name once it exists
+}
+
+void test_commit_updates() {
+    fresh_data_file();
+    {
+        database db;
+        account::pointer user = db.register_account("alice", 1);
+        db.register_account("bob", 2);
+        db.deposit(user, 25);
+        CHECK(db.change_password(user, 7, 3) == 1);
+        CHECK(db.change_password(user, 1, 3) == 0);
+        CHECK(db.commit_updates(user) == 0);
+        CHECK(db.commit_updates(account::create("carol", 1, 0)) == 1);
+    }
+    database reloaded;
+    CHECK(reloaded.get_account("alice", 1) == nullptr);
+    account::pointer user = reloaded.get_account("alice", 3);
+    CHECK(user && user->balance == 25);
+    CHECK(reloaded.get_account("bob", 2) != nullptr);
+}
+
+void test_snapshot() {
+    fresh_data_file();
+    database db;
+    for (int i = 0; i < 3; i++)
+        db.deposit(db.register_account("user" + std::to_string(i), i), 10 * i);
+    balance_snapshot snapshot = db.snapshot_balances();
+    CHECK(snapshot.balances.size() == 3 && snapshot.owners.size() == 3);
+    for (size_t i = 0; i < snapshot.balances.size(); i++)
+        CHECK(snapshot.balances[i] == 10 * i && snapshot.owners[i]->name == "user" + std::to_string(i));
+}
+
+// Changes made while a scan is between batches don't show up in it, but do in scans started later
+void test_scan_is_consistent() {
+    fresh_data_file();
+    database db;
+    std::vector<account::pointer> users;
+    for (int i = 0; i < SCAN_BATCH + 10; i++)
+        users.push_back(db.register_account("user" + std::to_string(i), i));
+    account::pointer last = users.back();
+
+    std::vector<account_record> seen;
+    std::vector<account_record> seen_by_nested;
+    CHECK(db.scan_accounts([&](const std::vector<account_record> &batch) {
+        if (seen.empty()) {
+            db.deposit(last, 50);
+            CHECK(db.change_password(last, SCAN_BATCH + 9, 99) == 0);
+            db.deposit(last, 50);
+            db.register_account("late", 0);
+            db.scan_accounts([&](const std::vector<account_record> &nested) {
+                seen_by_nested.insert(seen_by_nested.end(), nested.begin(), nested.end());
+                return true;
+            });
+        }
+        seen.insert(seen.end(), batch.begin(), batch.end());
+        return true;
+    }));
+    CHECK(seen.size() == users.size());
+    CHECK(seen.back().owner == last.get() && seen.back().balance == 0 && seen.back().pw_hash == SCAN_BATCH + 9);
+    CHECK(seen_by_nested.size() == users.size() + 1);
+    CHECK(seen_by_nested[users.size() - 1].balance == 100 && seen_by_nested[users.size() - 1].pw_hash == 99);
+    CHECK(db.snapshot_balances().balances[users.size() - 1] == 100);
+
+    int batches = 0;
+    CHECK(!db.scan_accounts([&](const std::vector<account_record> &batch) {
+        batches++;
+        return false;
+    }));
+    CHECK(batches == 1);
+}
+
+// A backup is the accounts as they were when it started, however they change while it runs
+void test_backup_is_consistent() {
+    fresh_data_file();
+    database db;
+    std::vector<account::pointer> users;
+    for (int i = 0; i < SCAN_BATCH + 10; i++)
+        users.push_back(db.register_account("user" + std::to_string(i), i));
+    account::pointer last = users.back();
+
+    std::string backup;
+    int chunks = 0;
+    CHECK(db.backup([&](const std::string &chunk) {
+        if (!chunks++) {
+            db.deposit(last, 50);
+            db.register_account("late", 0);
+            CHECK(db.backup([](const std::string &) { return true; }) == 2); // one at a time
+        }
+        backup += chunk;
+        return true;
+    }) == 0);
+    CHECK(chunks == 2);
+    std::istringstream in(backup);
+    std::string name;
+    unsigned long long pw_hash, balance;
+    size_t lines = 0;
+    while (in >> name >> pw_hash >> balance) {
+        CHECK(lines < users.size() && name == users[lines]->name && balance == 0);
+        lines++;
+    }
+    CHECK(lines == users.size());
+}
+
+// A backup that fails (or throws) doesn't stop the next one
+void test_failed_backup() {
+    fresh_data_file();
+    database db;
+    db.register_account("alice", 1);
+    CHECK(db.backup([](const std::string &) { return false; }) == 3);
+    try {
+        db.backup([](const std::string &) -> bool { throw std::runtime_error("write failed"); });
+        CHECK(false);
+    } catch (std::runtime_error &) {
+    }
+    CHECK(db.backup("backup.db") == 0);
+    std::ifstream in("backup.db");
+    std::string name;
+    CHECK(in >> name && name == "alice");
+}
+
+// A backup to a file replaces the one before it, and leaves no temporary file behind
+void test_backup_replaces_file() {
+    fresh_data_file();
+    database db;
+    std::ofstream("replaced.db") << "the previous backup\n";
+    db.register_account("alice", 1);
+    CHECK(db.backup("replaced.db") == 0);
+    std::ifstream in("replaced.db");
+    std::string name;
+    CHECK(in >> name && name == "alice");
+    CHECK(!std::ifstream("replaced.db.tmp"));
+}
+
+// An account's rate limit is shared by everyone logged in to it, and separate from other accounts
+void test_request_tokens() {
+    fresh_data_file();
+    database db;
+    account::pointer alice = db.register_account("alice", 1);
+    account::pointer bob = db.register_account("bob", 2);
+    token_bucket::clock::time_point now = token_bucket::clock::now();
+    CHECK(db.take_request_token(alice.get(), 5, 2, now));
+    CHECK(db.take_request_token(db.get_account("alice", 1).get(), 5, 2, now));
+    CHECK(!db.take_request_token(alice.get(), 5, 2, now));
+    CHECK(db.take_request_token(bob.get(), 5, 2, now));
+    CHECK(db.take_request_token(alice.get(), 0, 1, now)); // no limit
+}
+
+int main() {
+    test_transfer();
+    test_transfer_rolls_back();
+    test_has_account();
+    test_commit_updates();
+    test_snapshot();
+    test_scan_is_consistent();
+    test_backup_is_consistent();
+    test_failed_backup();
+    test_backup_replaces_file();
+    test_request_tokens();
+    return check_result();
+}
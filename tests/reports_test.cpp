@@ -0,0 +1,95 @@
+#include "check.h"
+#include "reports.h"
+#include <climits>
+#include <string>
+#include <vector>
+
+// A snapshot of made up accounts, one per balance
+struct test_snapshot {
+    test_snapshot(std::vector<unsigned long long> balances) {
+        for (size_t i = 0; i < balances.size(); i++)
+            accounts.push_back(account::create("user" + std::to_string(i), i, balances[i]));
+        for (const account::pointer &a : accounts) {
+            snapshot.balances.push_back(a->balance);
+            snapshot.owners.push_back(a.get());
+        }
+    }
+
+    std::vector<account::pointer> accounts;
+    balance_snapshot snapshot;
+};
+
+void test_parallel_chunks(asio::thread_pool &pool) {
+    for (size_t n : {0, 1, 5, 3 * REPORT_MIN_CHUNK + 7}) {
+        std::vector<std::pair<size_t, size_t>> chunks = parallel_chunks<std::pair<size_t, size_t>>(pool, n, [](size_t begin, size_t end) {
+            return std::make_pair(begin, end);
+        });
+        CHECK(!chunks.empty());
+        size_t covered = 0;
+        for (std::pair<size_t, size_t> &c : chunks) {
+            CHECK(c.first == std::min(covered, n) && c.first <= c.second);
+            covered = std::max(covered, c.second);
+        }
+        CHECK(covered == n);
+    }
+}
+
+void test_sum_balances(asio::thread_pool &pool) {
+    CHECK(sum_balances(pool, test_snapshot({}).snapshot) == 0);
+    CHECK(sum_balances(pool, test_snapshot({1, 2, 3}).snapshot) == 6);
+    std::vector<unsigned long long> many(2 * REPORT_MIN_CHUNK + 3, 2);
+    CHECK(sum_balances(pool, test_snapshot(many).snapshot) == 2 * many.size());
+}
+
+void test_top_balances(asio::thread_pool &pool) {
+    test_snapshot s({5, 1, 9, 7, 9, 0});
+    std::vector<std::pair<unsigned long long, const account *>> top = top_balances(pool, s.snapshot, 3);
+    CHECK(top.size() == 3);
+    CHECK(top[0].first == 9 && top[1].first == 9 && top[2].first == 7);
+    CHECK(top[2].second->name == "user3");
+    CHECK(top_balances(pool, s.snapshot, 0).empty());
+    CHECK(top_balances(pool, s.snapshot, 100).size() == 6);
+}
+
+void test_balance_histogram(asio::thread_pool &pool) {
+    test_snapshot s({0, 9, 10, 25, 1000, ULLONG_MAX});
+    std::vector<unsigned long long> counts = balance_histogram(pool, s.snapshot, 10, 3);
+    CHECK(counts == std::vector<unsigned long long>({2, 1, 3})); // the last bucket takes the rest
+    // a power of two width takes a different path, which should agree
+    CHECK(balance_histogram(pool, s.snapshot, 8, 3) == std::vector<unsigned long long>({1, 2, 3}));
+    CHECK(balance_histogram(pool, s.snapshot, 0, 2) == std::vector<unsigned long long>({1, 5})); // width 0 means 1
+    CHECK(balance_histogram(pool, s.snapshot, 10, 0).empty());
+    CHECK(balance_histogram(pool, s.snapshot, ULLONG_MAX, 2) == std::vector<unsigned long long>({5, 1}));
+}
+
+void test_histogram_bucket_start() {
+    CHECK(histogram_bucket_start(3, 10) == 30);
+    CHECK(histogram_bucket_start(3, 0) == 3);
+    CHECK(histogram_bucket_start(1, ULLONG_MAX) == ULLONG_MAX);
+    CHECK(histogram_bucket_start(2, ULLONG_MAX) == ULLONG_MAX);
+    CHECK(histogram_bucket_start(999, ULLONG_MAX / 500) == ULLONG_MAX);
+}
+
+void test_is_admin() {
+    account::pointer boss = account::create("boss", 1, 0);
+    account::pointer other = account::create("other", 2, 0);
+    report_service reports("boss");
+    CHECK(reports.is_admin(boss.get()));
+    CHECK(!reports.is_admin(other.get()));
+    CHECK(!reports.is_admin(nullptr)); // not logged in
+    report_service no_admin("");
+    CHECK(!no_admin.is_admin(boss.get()));
+    CHECK(!no_admin.is_admin(account::create("", 0, 0).get()));
+}
+
+int main() {
+    asio::thread_pool pool;
+    test_parallel_chunks(pool);
+    test_sum_balances(pool);
+    test_top_balances(pool);
+    test_balance_histogram(pool);
+    test_histogram_bucket_start();
+    test_is_admin();
+    pool.join();
+    return check_result();
+}
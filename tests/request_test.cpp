@@ -0,0 +1,22 @@
+#include "check.h"
+#include "request.h"
+#include <string>
+
+void test_new_request() {
+    request req = new_request(request_type::deposit, "1000");
+    CHECK(req.header.type == request_type::deposit);
+    CHECK(req.header.body_size == 5); // includes the null terminator
+    CHECK(std::string(req.body) == "1000");
+}
+
+void test_new_request_truncates() {
+    request req = new_request(request_type::response, std::string(MAX_BODY_LEN + 50, 'x'));
+    CHECK(req.header.body_size == MAX_BODY_LEN + 1);
+    CHECK(std::string(req.body) == std::string(MAX_BODY_LEN, 'x'));
+}
+
+int main() {
+    test_new_request();
+    test_new_request_truncates();
+    return check_result();
+}
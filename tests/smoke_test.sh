@@ -0,0 +1,85 @@
+# Starts the server in a scratch directory and runs short benches against it.
+# Usage: smoke_test.sh <server> <bench> <quotes.txt> <scratch dir>
+set -e
+server=$1
+bench=$2
+quotes=$3
+dir=$4
+shift 4
+port=45671
+pid=
+
+rm -rf "$dir"
+mkdir -p "$dir"
+cp "$quotes" "$dir"
+cd "$dir"
+trap '[ -z "$pid" ] || kill $pid 2>/dev/null || true' EXIT
+
+# start_server [options]: runs the server on $port with those options
+start_server() {
+    "$server" $port "$@" &
+    pid=$!
+    sleep 1
+}
+
+# refuse_to_start message [options]: checks the server won't start with those options
+refuse_to_start() {
+    message=$1
+    shift
+    "$server" $port "$@" &
+    pid=$!
+    sleep 1
+    if kill -0 $pid 2>/dev/null; then
+        echo "server started with $message"
+        exit 1
+    fi
+    if wait $pid; then
+        echo "server exited successfully with $message"
+        exit 1
+    fi
+    pid=
+}
+
+# stop_server: Ctrl+C, which should shut the server down cleanly
+stop_server() {
+    kill -INT $pid
+    wait $pid
+    pid=
+}
+
+start_server --unix "$dir/bank.sock"
+"$bench" 127.0.0.1 $port 4 500
+"$bench" "unix:$dir/bank.sock" $port 2 200
+"$bench" --connect 127.0.0.1 $port 4 50
+stop_server
+
+# socket buffers far smaller than the defaults
+start_server --sndbuf 4096 --rcvbuf 4096
+"$bench" 127.0.0.1 $port 4 200
+stop_server
+
+# several threads sharing one set of acceptors, which hand connections out in turn
+start_server --threads 4 --accepts 4 --unix "$dir/bank.sock"
+"$bench" 127.0.0.1 $port 8 300
+"$bench" "unix:$dir/bank.sock" $port 4 100
+"$bench" --connect 127.0.0.1 $port 8 50
+stop_server
+
+# every thread with its own SO_REUSEPORT acceptors
+start_server --threads 4 --reuseport --accepts 4
+"$bench" 127.0.0.1 $port 8 300
+"$bench" --connect 127.0.0.1 $port 8 50
+stop_server
+
+# --admin only starts with an admin account that's already registered, since otherwise anyone
+# could register the name and get the admin requests
+refuse_to_start "an unregistered admin account" --admin smoke_admin
+printf "%30s%21s%21s\n" smoke_admin 42 0 >> accounts.db
+# and backups need a directory of their own
+refuse_to_start "a missing backup directory" --admin smoke_admin --backup-dir backups
+refuse_to_start "its own directory for backups" --admin smoke_admin --backup-dir "$dir"
+mkdir backups
+start_server --admin smoke_admin --backup-dir backups
+kill -0 $pid
+"$bench" 127.0.0.1 $port 2 100
+stop_server
@@ -0,0 +1,38 @@
+#include "check.h"
+#include "token_bucket.h"
+#include <chrono>
+
+void test_no_limit() {
+    token_bucket bucket;
+    token_bucket::clock::time_point now = token_bucket::clock::now();
+    for (int i = 0; i < 1000; i++)
+        CHECK(bucket.take(0, 1, now));
+}
+
+void test_starts_full_and_refills() {
+    token_bucket bucket;
+    token_bucket::clock::time_point now = token_bucket::clock::now();
+    for (int i = 0; i < 3; i++)
+        CHECK(bucket.take(10, 3, now)); // the whole burst straight away
+    CHECK(!bucket.take(10, 3, now));
+    CHECK(!bucket.take(10, 3, now + std::chrono::milliseconds(50))); // half a token so far
+    CHECK(bucket.take(10, 3, now + std::chrono::milliseconds(100)));
+    CHECK(!bucket.take(10, 3, now + std::chrono::milliseconds(100)));
+}
+
+void test_refill_is_capped_at_burst() {
+    token_bucket bucket;
+    token_bucket::clock::time_point now = token_bucket::clock::now();
+    CHECK(bucket.take(10, 2, now));
+    now += std::chrono::seconds(60); // enough for 600 tokens, but the bucket only holds 2
+    CHECK(bucket.take(10, 2, now));
+    CHECK(bucket.take(10, 2, now));
+    CHECK(!bucket.take(10, 2, now));
+}
+
+int main() {
+    test_no_limit();
+    test_starts_full_and_refills();
+    test_refill_is_capped_at_burst();
+    return check_result();
+}